@@ -0,0 +1,206 @@
+#include "Collector.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#define GC_MIN_THRESHOLD    10000
+
+malGcTracked* malCollector::s_tracked = NULL;
+int malCollector::s_allocated = 0;
+int malCollector::s_threshold = GC_MIN_THRESHOLD;
+malGcStats malCollector::s_stats = { 0, 0, 0, 0, 0 };
+
+#if DEBUG_REFCOUNT_STATS
+unsigned long RefCounted::s_acquires = 0;
+unsigned long RefCounted::s_releases = 0;
+#endif
+
+int RefCounted::s_pending = 0;
+int RefCounted::s_reclaimBudget = 0;
+
+// Leaked, so objects released during static destruction still find it.
+static std::vector<const RefCounted*>& reclaimQueue()
+{
+    static std::vector<const RefCounted*>* queue =
+        new std::vector<const RefCounted*>;
+    return *queue;
+}
+
+static bool s_isReclaiming = false;
+
+void RefCounted::reclaim(const RefCounted* object)
+{
+    reclaimQueue().push_back(object);
+    s_pending++;
+    if (!s_isReclaiming) {
+        drain(s_reclaimBudget);
+    }
+}
+
+int RefCounted::drain(int budget)
+{
+    std::vector<const RefCounted*>& queue = reclaimQueue();
+    s_isReclaiming = true;
+    for (int n = 0; !queue.empty() && (budget <= 0 || n < budget); n++) {
+        const RefCounted* object = queue.back();
+        queue.pop_back();
+        s_pending--;
+        delete object;
+    }
+    s_isReclaiming = false;
+    return s_pending;
+}
+
+malGcTracked::malGcTracked()
+: m_prev(NULL)
+, m_next(malCollector::s_tracked)
+{
+    if (m_next) {
+        m_next->m_prev = this;
+    }
+    malCollector::s_tracked = this;
+    malCollector::s_allocated++;
+    malCollector::s_stats.tracked++;
+}
+
+malGcTracked::~malGcTracked()
+{
+    if (m_prev) {
+        m_prev->m_next = m_next;
+    }
+    else {
+        malCollector::s_tracked = m_next;
+    }
+    if (m_next) {
+        m_next->m_prev = m_prev;
+    }
+    malCollector::s_stats.tracked--;
+}
+
+namespace {
+
+struct Node {
+    int refs;
+    bool isReachable;
+};
+
+typedef std::unordered_map<const RefCounted*, Node> NodeMap;
+
+// Trial deletion: start from each object's refcount and take off the
+// references it gets from within the scanned objects. Whatever is left
+// comes from outside, the C++ stack, the root env or a side table.
+class Scanner : public RefVisitor {
+public:
+    Scanner(NodeMap& nodes, std::vector<const RefCounted*>& order)
+        : m_nodes(nodes), m_order(order) { }
+
+    Node& add(const RefCounted* object) {
+        auto it = m_nodes.emplace(object, Node{ object->refCount(), false });
+        if (it.second) {
+            m_order.push_back(object);
+        }
+        return it.first->second;
+    }
+
+    virtual void visit(const RefCounted* object) {
+        // Leaves can't be part of a cycle. Neither can the root env, which
+        // isn't flagged, as scanning it would mean scanning everything.
+        if (object->hasFlag(RefCounted::GC_CONTAINER)) {
+            add(object).refs--;
+        }
+    }
+
+private:
+    NodeMap& m_nodes;
+    std::vector<const RefCounted*>& m_order;
+};
+
+// Anything reachable from an object with references left is alive.
+class Marker : public RefVisitor {
+public:
+    Marker(NodeMap& nodes) : m_nodes(nodes) { }
+
+    void mark(const RefCounted* object) {
+        m_pending.push_back(object);
+        while (!m_pending.empty()) {
+            const RefCounted* next = m_pending.back();
+            m_pending.pop_back();
+            next->traverse(*this);
+        }
+    }
+
+    virtual void visit(const RefCounted* object) {
+        auto it = m_nodes.find(object);
+        if (it != m_nodes.end() && !it->second.isReachable) {
+            it->second.isReachable = true;
+            m_pending.push_back(object);
+        }
+    }
+
+private:
+    NodeMap& m_nodes;
+    std::vector<const RefCounted*> m_pending;
+};
+
+}
+
+const malGcStats& malCollector::collect()
+{
+    // Objects waiting to be deleted have no references left, but are
+    // still on the tracked list.
+    RefCounted::drain(0);
+
+    NodeMap nodes;
+    std::vector<const RefCounted*> order;
+    Scanner scanner(nodes, order);
+    for (malGcTracked* it = s_tracked; it; it = it->m_next) {
+        const RefCounted* object = it->gcObject();
+        if (object->hasFlag(RefCounted::GC_CONTAINER)) {
+            scanner.add(object);
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i]->traverse(scanner);
+    }
+
+    Marker marker(nodes);
+    for (auto& node : nodes) {
+        if (node.second.refs > 0 && !node.second.isReachable) {
+            node.second.isReachable = true;
+            marker.mark(node.first);
+        }
+    }
+
+    // Clearing the tracked objects breaks every garbage cycle. Hold on to
+    // them meanwhile, so none is deleted while another is being cleared.
+    std::vector<malGcTracked*> garbage;
+    std::vector<RefCountedPtr<const RefCounted>> holders;
+    for (malGcTracked* it = s_tracked; it; it = it->m_next) {
+        auto node = nodes.find(it->gcObject());
+        if (node != nodes.end() && !node->second.isReachable) {
+            garbage.push_back(it);
+            holders.push_back(it->gcObject());
+        }
+    }
+    for (malGcTracked* it : garbage) {
+        it->gcClear();
+    }
+
+    int freed = std::count_if(nodes.begin(), nodes.end(),
+        [](const NodeMap::value_type& node) {
+            return !node.second.isReachable;
+        });
+    holders.clear();
+
+    s_stats.collections++;
+    s_stats.scanned = nodes.size();
+    s_stats.freed = freed;
+    s_stats.totalFreed += freed;
+    s_allocated = 0;
+    // Wait for about as many new objects as this run had to look at, so
+    // a large live structure isn't scanned over and over.
+    s_threshold = std::max({ GC_MIN_THRESHOLD, s_stats.tracked,
+                             s_stats.scanned - freed });
+    return s_stats;
+}
@@ -0,0 +1,56 @@
+#ifndef INCLUDE_COLLECTOR_H
+#define INCLUDE_COLLECTOR_H
+
+#include "RefCountedPtr.h"
+
+// Base of the objects that can change after construction: envs, atoms
+// and cells. Lists, hashes and lambdas can only refer to things that
+// existed before them, so every reference cycle passes through one of
+// these, and the live ones are all the roots the cycle collector needs.
+class malGcTracked {
+public:
+    malGcTracked();
+    virtual ~malGcTracked();
+
+    // Drops every reference held, to break a cycle found to be garbage.
+    virtual void gcClear() = 0;
+    virtual const RefCounted* gcObject() const = 0;
+
+private:
+    malGcTracked(const malGcTracked&); // no copy ctor
+
+    malGcTracked* m_prev;
+    malGcTracked* m_next;
+
+    friend class malCollector;
+};
+
+struct malGcStats {
+    int collections;
+    int scanned;     // objects looked at by the last collection
+    int freed;       // garbage found by the last collection
+    int totalFreed;
+    int tracked;     // envs, atoms and cells currently alive
+};
+
+// Backup for reference counting, which can't free cycles such as a
+// closure stored in the env it closes over.
+class malCollector {
+public:
+    // True once enough tracked objects were created since the last run.
+    // Checked by the evaluator at points where collecting is safe.
+    static bool isDue() { return s_allocated >= s_threshold; }
+
+    static const malGcStats& collect();
+    static const malGcStats& stats() { return s_stats; }
+
+private:
+    static malGcTracked* s_tracked;
+    static int s_allocated;
+    static int s_threshold;
+    static malGcStats s_stats;
+
+    friend class malGcTracked;
+};
+
+#endif // INCLUDE_COLLECTOR_H
@@ -1,18 +1,30 @@
 #include "MAL.h"
+#include "DirectoryWalker.h"
 #include "Environment.h"
+#include "EventLoop.h"
+#include "FileCache.h"
+#include "Printer.h"
+#include "Process.h"
 #include "StaticList.h"
 #include "Types.h"
+#include "Wildcard.h"
 
 #include <chrono>
 #include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <memory>
+#include <thread>
 #include <stdio.h>
+#include <string.h>
 #include <cstdlib>
 #include <unistd.h>
 #include <sys/select.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 /* temp defined */
 #include <regex>
@@ -102,13 +114,54 @@ bool argsHasFloat(malValueIter argsBegin, malValueIter argsEnd)
             MAL_CHECK(intVal->value() != 0, "Division by zero"); } \
     }
 
+static void printValues(malPrinter& out, malValueIter begin, malValueIter end,
+                        std::string_view sep, bool readably);
 static String printValues(malValueIter begin, malValueIter end,
-                           const String& sep, bool readably);
+                          std::string_view sep, bool readably);
 
 static int countValues(malValueIter begin, malValueIter end);
 
+static malValuePtr printForm(const String& name,
+                             malValueIter argsBegin, malValueIter argsEnd,
+                             std::string_view before, std::string_view after);
+
+static void appendText(String& out, const malValuePtr& value);
+static malValuePtr joinValues(malValueIter begin, malValueIter end);
+static std::string_view textOf(const malValuePtr& value);
+
+static malValuePtr nthItem(malStream* stream, int64_t index);
+static malValuePtr remainingItems(malStream* stream);
+
+static String readFile(const String& path);
+
+static StringVec commandOf(const malValuePtr& command);
+static malValuePtr unixSocket(const String& path, bool isListening);
+static malValuePtr socketFile(int fd, const String& path);
+static malProcess::Stream streamOption(const malHash* options,
+                                       const char* name,
+                                       malProcess::Stream otherwise);
+
+// A binary field named by a keyword: :u8, :s8, then :u16, :s16, :u32,
+// :s32, :u64, :s64, :f32 and :f64, each with an le or be suffix for its
+// byte order, little-endian when there is none.
+struct BinaryField {
+    char kind;          // 'u'nsigned, 's'igned or 'f'loat
+    size_t size;        // in bytes
+    bool isBigEndian;
+};
+
+static BinaryField binaryField(const malKeyword* format);
+static malValuePtr getField(malBytes* bytes, int64_t offset,
+                            const BinaryField& field);
+static void putField(malBytes* bytes, int64_t offset,
+                     const BinaryField& field, const malValuePtr& value);
+
 static StaticList<malBuiltIn*> handlers;
 
+// The env the builtins were installed into, where the output ones look up
+// *print-length* and *print-level*.
+static malEnv* s_coreEnv = NULL;
+
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
@@ -212,7 +265,7 @@ unsigned char itoa64(const int64_t &sign)
 
     if(sign < 0)
     {
-        std::cout << "Warning: out of char value!" << std::endl;
+        malOutputPort::console().write("Warning: out of char value!\n");
         return result;
     }
 
@@ -247,61 +300,6 @@ int kbhit()
     return bytesWaiting;
 }
 
-bool compareNat(const String& a, const String& b)
-{
-    //std::cout << a << " " << b << std::endl;
-    if (a.empty()) {
-        return true;
-    }
-    if (b.empty()) {
-        return false;
-    }
-    if (std::isdigit(a[0]) && !std::isdigit(b[0])) {
-        return false;
-    }
-    if (!std::isdigit(a[0]) && std::isdigit(b[0])) {
-        return false;
-    }
-    if (!std::isdigit(a[0]) && !std::isdigit(b[0])) {
-        //std::cout << "HIT no dig" << std::endl;
-        if (a[0] == '.' &&
-            b[0] == '.' &&
-            a.size() > 1 &&
-            b.size() > 1) {
-            return (std::toupper(a[1]) < std::toupper(b[1]));
-        }
-
-        if (std::toupper(a[0]) == std::toupper(b[0])) {
-            return compareNat(a.substr(1), b.substr(1));
-        }
-        return (std::toupper(a[0]) < std::toupper(b[0]));
-    }
-
-    // Both strings begin with digit --> parse both numbers
-    std::istringstream issa(a);
-    std::istringstream issb(b);
-    int ia, ib;
-    issa >> ia;
-    issb >> ib;
-    if (ia != ib)
-        return ia < ib;
-
-    // Numbers are the same --> remove numbers and recurse
-    String anew, bnew;
-    std::getline(issa, anew);
-    std::getline(issb, bnew);
-    return (compareNat(anew, bnew));
-}
-
-template <typename TP>
-std::time_t to_time_t(TP tp)
-{
-    using namespace std::chrono;
-    auto sctp = time_point_cast<system_clock::duration>(tp - TP::clock::now()
-              + system_clock::now());
-    return system_clock::to_time_t(sctp);
-}
-
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("double?",      malDouble);
 BUILTIN_ISA("file?",        malFile);
@@ -584,6 +582,135 @@ BUILTIN("boolean?")
     }
 }
 
+BUILTIN("builder->string")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malStringBuilder, builder);
+    return mal::string(builder->view());
+}
+
+BUILTIN("builder-append")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malStringBuilder, builder);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        appendText(builder->text(), *it);
+    }
+    return malValuePtr(builder);
+}
+
+BUILTIN("builder-insert")
+{
+    CHECK_ARGS_AT_LEAST(2);
+    ARG(malStringBuilder, builder);
+    AG_INT(index);
+    MAL_CHECK(index->value() >= 0 &&
+              index->value() <= (int64_t)builder->view().size(),
+              "Index out of range");
+    String text;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        appendText(text, *it);
+    }
+    builder->text().insert(index->value(), text);
+    return malValuePtr(builder);
+}
+
+BUILTIN("builder-length")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malStringBuilder, builder);
+    return mal::integer(builder->view().size());
+}
+
+BUILTIN("bytes")
+{
+    // Zeroed bytes of the given size, or the bytes of a string or of a
+    // sequence of integers.
+    CHECK_ARGS_IS(1);
+    if (argsBegin->ptr()->type() == MALTYPE::INT) {
+        AG_INT(size);
+        MAL_CHECK(size->value() >= 0, "Size must not be negative");
+        return mal::bytes(size->value());
+    }
+    if (const malString* s = DYNAMIC_CAST(malString, *argsBegin)) {
+        return mal::bytes(s->view());
+    }
+    ARG(malSequence, seq);
+    malValuePtr result = mal::bytes(seq->count());
+    std::vector<uint8_t>& data = STATIC_CAST(malBytes, result)->data();
+    for (int i = 0; i < seq->count(); i++) {
+        int64_t byte = VALUE_CAST(malInteger, seq->item(i))->value();
+        MAL_CHECK(byte >= 0 && byte <= 255, "Byte out of range");
+        data[i] = byte;
+    }
+    return result;
+}
+
+BUILTIN("bytes->string")
+{
+    int args = CHECK_ARGS_BETWEEN(1, 3);
+    ARG(malBytes, bytes);
+    int64_t size = bytes->size();
+    int64_t start = 0;
+    int64_t length = size;
+    if (args > 1) {
+        AG_INT(from);
+        start = from->value();
+        length = size - start;
+    }
+    if (args > 2) {
+        AG_INT(count);
+        length = count->value();
+    }
+    MAL_CHECK(start >= 0 && length >= 0 && start + length <= size,
+              "Index out of range");
+    return mal::string(bytes->view().substr(start, length));
+}
+
+BUILTIN("bytes-get")
+{
+    // (bytes-get bytes offset :u32le), see binaryField for the types.
+    // Given a count, a vector of that many fields, one after the other.
+    int args = CHECK_ARGS_BETWEEN(3, 4);
+    ARG(malBytes, bytes);
+    AG_INT(offset);
+    ARG(malKeyword, format);
+    BinaryField field = binaryField(format);
+    if (args == 3) {
+        return getField(bytes, offset->value(), field);
+    }
+    AG_INT(count);
+    MAL_CHECK(count->value() >= 0, "Size must not be negative");
+    int64_t at = offset->value();
+    // Divided rather than multiplied, which a huge count would overflow.
+    MAL_CHECK(at >= 0 && (uint64_t)at <= bytes->size()
+              && (uint64_t)count->value() <= (bytes->size() - at) / field.size,
+              "Index out of range");
+    malValueVec* items = new malValueVec(count->value());
+    for (auto& item : *items) {
+        item = getField(bytes, at, field);
+        at += field.size;
+    }
+    return mal::vector(items);
+}
+
+BUILTIN("bytes-length")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malBytes, bytes);
+    return mal::integer(bytes->size());
+}
+
+BUILTIN("bytes-put")
+{
+    CHECK_ARGS_IS(4);
+    ARG(malBytes, bytes);
+    AG_INT(offset);
+    ARG(malKeyword, format);
+    putField(bytes, offset->value(), binaryField(format), *argsBegin);
+    return malValuePtr(bytes);
+}
+
 #if 0
 BUILTIN("car")
 {
@@ -731,6 +858,9 @@ BUILTIN("count")
     if (*argsBegin == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (malStream* stream = DYNAMIC_CAST(malStream, *argsBegin)) {
+        return mal::integer(stream->skip(INT64_MAX));
+    }
 
     ARG(malSequence, seq);
     return mal::integer(seq->count());
@@ -744,6 +874,34 @@ BUILTIN("deref")
     return atom->deref();
 }
 
+BUILTIN("directory-seq")
+{
+    // The paths under directory, matching pattern and of the kinds given
+    // as for vl-directory-files, handed out as they are found, unsorted.
+    int args = CHECK_ARGS_BETWEEN(1, 3);
+    ARG(malString, directory);
+    String pattern;
+    int kinds = malDirectoryWalker::FILES;
+    if (args > 1 && !NIL_PTR) {
+        ARG(malString, wildcard);
+        pattern = wildcard->value();
+    }
+    else if (args > 1) {
+        argsBegin++;
+    }
+    if (args > 2) {
+        AG_INT(directories);
+        kinds = directories->value();
+        if (kinds > 1 || kinds < -1) {
+            kinds = malDirectoryWalker::ALL;
+        }
+    }
+    if (!malFileCache::lookup(directory->value()).isDirectory) {
+        return mal::nilValue();
+    }
+    return mal::directorySeq(directory->value(), pattern, kinds);
+}
+
 BUILTIN("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
@@ -766,6 +924,84 @@ BUILTIN("eval")
     return EVAL(*argsBegin, NULL);
 }
 
+BUILTIN("event-after")
+{
+    // (event-after milliseconds callback [interval]): calls back once the
+    // time is up, then every interval milliseconds if one is given.
+    int args = CHECK_ARGS_BETWEEN(2, 3);
+    AG_INT(milliseconds);
+    malValuePtr callback = *argsBegin++;
+    int64_t interval = 0;
+    if (args > 2) {
+        AG_INT(every);
+        MAL_CHECK(every->value() > 0, "Bad interval %lld",
+                  (long long)every->value());
+        interval = every->value();
+    }
+    return mal::integer(malEventLoop::startTimer(milliseconds->value(),
+                                                 interval, callback));
+}
+
+BUILTIN("event-cancel")
+{
+    CHECK_ARGS_IS(1);
+    AG_INT(id);
+    return malEventLoop::cancel(id->value()) ? mal::trueValue()
+                                             : mal::nilValue();
+}
+
+BUILTIN("event-count")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(malEventLoop::count());
+}
+
+BUILTIN("event-on")
+{
+    // (event-on source event callback), with :readable or :writable for a
+    // file, pipe or socket, and :exit for a process.
+    CHECK_ARGS_IS(3);
+    malValuePtr source = *argsBegin++;
+    ARG(malKeyword, event);
+    malValuePtr callback = *argsBegin++;
+    if (malProcess* process = DYNAMIC_CAST(malProcess, source)) {
+        MAL_CHECK(event->view() == ":exit", "Bad event %s for a process",
+                  String(event->view()).c_str());
+        return mal::integer(malEventLoop::watchProcess(process, callback));
+    }
+    malFile* file = VALUE_CAST(malFile, source);
+    malEventLoop::Event kind = malEventLoop::READABLE;
+    if (event->view() == ":writable") {
+        kind = malEventLoop::WRITABLE;
+    }
+    else {
+        MAL_CHECK(event->view() == ":readable", "Bad event %s for a file",
+                  String(event->view()).c_str());
+    }
+    return mal::integer(malEventLoop::watchFile(file, kind, callback));
+}
+
+BUILTIN("event-run")
+{
+    // (event-run [timeout]): calls back what is ready until nothing is
+    // watched, event-stop is called, or timeout milliseconds have passed.
+    // How many callbacks were called.
+    int args = CHECK_ARGS_BETWEEN(0, 1);
+    int timeout = -1;
+    if (args > 0) {
+        AG_INT(milliseconds);
+        timeout = std::max<int64_t>(0, milliseconds->value());
+    }
+    return mal::integer(malEventLoop::run(timeout));
+}
+
+BUILTIN("event-stop")
+{
+    CHECK_ARGS_IS(0);
+    malEventLoop::stop();
+    return mal::nilValue();
+}
+
 BUILTIN("exit")
 {
     CHECK_ARGS_IS(0);
@@ -818,6 +1054,70 @@ BUILTIN("expt")
     }
 }
 
+BUILTIN("file-cache")
+{
+    // (file-cache [on [ttl]]) turns the cache of file metadata on or off,
+    // emptying it, and sets how many milliseconds paths that can't be
+    // watched are kept. Returns whether it was on.
+    int args = CHECK_ARGS_BETWEEN(0, 2);
+    bool wasEnabled = malFileCache::isEnabled();
+    if (args > 0) {
+        malFileCache::setEnabled((*argsBegin++)->isTrue());
+    }
+    if (args > 1) {
+        AG_INT(ttl);
+        MAL_CHECK(ttl->value() >= 0, "TTL must not be negative");
+        malFileCache::setTtl(ttl->value());
+    }
+    return wasEnabled ? mal::trueValue() : mal::nilValue();
+}
+
+BUILTIN("file-cache-stats")
+{
+    CHECK_ARGS_IS(0);
+    malFileCacheStats stats = malFileCache::stats();
+    malHash::Map map;
+    map[":hits"] = mal::integer(stats.hits);
+    map[":misses"] = mal::integer(stats.misses);
+    map[":invalidations"] = mal::integer(stats.invalidations);
+    map[":entries"] = mal::integer(stats.entries);
+    map[":watches"] = mal::integer(stats.watches);
+    map[":ttl"] = mal::integer(malFileCache::ttl());
+    return mal::hash(map);
+}
+
+BUILTIN("file-position")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malFile, pf);
+    MAL_CHECK(pf->isOpen(), "i/o file is closed");
+    return mal::integer(pf->position());
+}
+
+BUILTIN("file-seek")
+{
+    // (file-seek file offset [:set | :cur | :end]), :set by default.
+    int args = CHECK_ARGS_BETWEEN(2, 3);
+    ARG(malFile, pf);
+    AG_INT(offset);
+    int whence = SEEK_SET;
+    if (args == 3) {
+        ARG(malKeyword, from);
+        if (from->view() == ":cur") {
+            whence = SEEK_CUR;
+        }
+        else if (from->view() == ":end") {
+            whence = SEEK_END;
+        }
+        else {
+            MAL_CHECK(from->view() == ":set", "Bad seek origin %s",
+                      String(from->view()).c_str());
+        }
+    }
+    MAL_CHECK(pf->isOpen(), "i/o file is closed");
+    return mal::integer(pf->seek(offset->value(), whence));
+}
+
 BUILTIN("first")
 {
     CHECK_ARGS_IS(1);
@@ -860,6 +1160,32 @@ BUILTIN("float")
     }
 }
 
+BUILTIN("flush")
+{
+    // Writes out what is buffered for the console, or for a file.
+    if (CHECK_ARGS_BETWEEN(0, 1) == 0) {
+        malOutputPort::console().flush();
+        return mal::nilValue();
+    }
+    ARG(malFile, pf);
+    pf->flush();
+    return mal::nilValue();
+}
+
+BUILTIN("free-budget")
+{
+    // How many dead objects one release may delete before the rest are
+    // left to the evaluator's safe points. 0 deletes them all at once.
+    int args = CHECK_ARGS_BETWEEN(0, 1);
+    int budget = RefCounted::reclaimBudget();
+    if (args == 1) {
+        ARG(malInteger, value);
+        MAL_CHECK(value->value() >= 0, "Budget must not be negative");
+        RefCounted::setReclaimBudget(value->value());
+    }
+    return mal::integer(budget);
+}
+
 BUILTIN("fn?")
 {
     CHECK_ARGS_IS(1);
@@ -873,6 +1199,25 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+
+    // Frees unreachable reference cycles now, rather than waiting for the
+    // evaluator to do it, and reports what the run found. Pending is what
+    // was still queued for deletion beforehand, see free-budget.
+    int pending = RefCounted::pending();
+    const malGcStats& stats = malCollector::collect();
+    malHash::Map map;
+    map[":collections"] = mal::integer(stats.collections);
+    map[":scanned"] = mal::integer(stats.scanned);
+    map[":freed"] = mal::integer(stats.freed);
+    map[":pending"] = mal::integer(pending);
+    map[":total-freed"] = mal::integer(stats.totalFreed);
+    map[":tracked"] = mal::integer(stats.tracked);
+    return mal::hash(map);
+}
+
 BUILTIN("get")
 {
     CHECK_ARGS_IS(2);
@@ -900,8 +1245,9 @@ BUILTIN("getint")
     if (CHECK_ARGS_AT_LEAST(0))
     {
         ARG(malString, str);
-        std::cout << str->value();
+        malOutputPort::console().write(str->view());
     }
+    malOutputPort::console().flush();
     int x = 0;
     while(1)
     {
@@ -909,7 +1255,8 @@ BUILTIN("getint")
         if (!std::cin.fail()) break;
         std::cin.clear();
         std::cin.ignore(10000,'\n');
-        std::cout << "Bad entry. Enter a NUMBER: ";
+        malOutputPort::console().write("Bad entry. Enter a NUMBER: ");
+        malOutputPort::console().flush();
     }
     return mal::integer(x);
 }
@@ -919,8 +1266,9 @@ BUILTIN("getreal")
     if (CHECK_ARGS_AT_LEAST(0))
     {
         ARG(malString, str);
-        std::cout << str->value();
+        malOutputPort::console().write(str->view());
     }
+    malOutputPort::console().flush();
     float x = 0;
     while(1)
     {
@@ -928,7 +1276,8 @@ BUILTIN("getreal")
         if (!std::cin.fail()) break;
         std::cin.clear();
         std::cin.ignore(10000,'\n');
-        std::cout << "Bad entry. Enter a NUMBER: ";
+        malOutputPort::console().write("Bad entry. Enter a NUMBER: ");
+        malOutputPort::console().flush();
     }
     return mal::mdouble(x);
 }
@@ -942,7 +1291,8 @@ BUILTIN("getstring")
         argsBegin++;
     }
     ARG(malString, str);
-    std::cout << str->value();
+    malOutputPort::console().write(str->view());
+    malOutputPort::console().flush();
     String s = "";
     std::getline(std::cin >> std::ws, s);
     return mal::string(s);
@@ -980,6 +1330,14 @@ BUILTIN("last")
     return seq->item(seq->count()-1);
 }
 
+BUILTIN("line-seq")
+{
+    // The lines of an open file, read as they are needed.
+    CHECK_ARGS_IS(1);
+    ARG(malFile, pf);
+    return mal::lineSeq(pf, false);
+}
+
 BUILTIN("list")
 {
     return mal::list(argsBegin, argsEnd);
@@ -991,6 +1349,35 @@ BUILTIN("listp")
     return (DYNAMIC_CAST(malList, *argsBegin)) ? mal::trueValue() : mal::nilValue();
 }
 
+BUILTIN("load-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    // Read every form up front, so a syntax error anywhere in the file
+    // stops the load before anything is evaluated.
+    std::unique_ptr<malValueVec> forms(readForms(readFile(filename->value())));
+    for (auto it = forms->begin(), end = forms->end(); it != end; ++it) {
+        EVAL(*it, NULL);
+    }
+    return mal::nilValue();
+}
+
+BUILTIN("load-data")
+{
+    // Every form in a file of data, as read-data reads them, in a list.
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    // Big files are read where they are mapped, without a copy.
+    malStringBufferPtr mapped(malStringBuffer::map(filename->value()));
+    if (mapped) {
+        std::string_view text(mapped->data(), mapped->size());
+        return mal::list(readDataForms(text));
+    }
+    return mal::list(readDataForms(readFile(filename->value())));
+}
+
 BUILTIN("log")
 {
     BUILTIN_FUNCTION(log);
@@ -1073,6 +1460,14 @@ BUILTIN("map")
 {
     CHECK_ARGS_IS(2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    if (malStream* stream = DYNAMIC_CAST(malStream, *argsBegin)) {
+        malValueVec* items = new malValueVec;
+        malValueVec item(1);
+        while ((item[0] = stream->next()) != mal::nilValue()) {
+            items->push_back(APPLY(op, item.begin(), item.end()));
+        }
+        return mal::list(items);
+    }
     ARG(malSequence, source);
 
     const int length = source->count();
@@ -1095,6 +1490,13 @@ BUILTIN("mapcar")
     int listCounts[listCount];
     const malValuePtr op = EVAL(argsBegin++->ptr(), NULL);
 
+    // The result is as long as the longest list anyway.
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        if (malStream* stream = DYNAMIC_CAST(malStream, *it)) {
+            *it = remainingItems(stream);
+        }
+    }
+
     for (auto it = argsBegin++; it != argsEnd; it++) {
         const malSequence* seq = VALUE_CAST(malSequence, *it);
         listCounts[i++] = seq->count();
@@ -1308,6 +1710,12 @@ BUILTIN("min")
     }
 }
 
+BUILTIN("not")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(!argsBegin->ptr()->isTrue());
+}
+
 BUILTIN("nth")
 {
     // twisted parameter for both LISPs!
@@ -1317,6 +1725,9 @@ BUILTIN("nth")
     if(INT_PTR)
     {
         AG_INT(index);
+        if (malStream* stream = DYNAMIC_CAST(malStream, *argsBegin)) {
+            return nthItem(stream, index->value());
+        }
         ARG(malSequence, seq);
         i = index->value();
         MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
@@ -1329,6 +1740,11 @@ BUILTIN("nth")
         return mal::nilValue();
     }
     else {
+        if (malStream* stream = DYNAMIC_CAST(malStream, *argsBegin)) {
+            argsBegin++;
+            AG_INT(index);
+            return nthItem(stream, index->value());
+        }
         ARG(malSequence, seq);
         AG_INT(index);
         i = index->value();
@@ -1369,6 +1785,20 @@ BUILTIN("open")
     return pf->open();
 }
 
+BUILTIN("output-buffer-size")
+{
+    // How much console output is held before it is written out.
+    int args = CHECK_ARGS_BETWEEN(0, 1);
+    malOutputPort& console = malOutputPort::console();
+    size_t size = console.bufferSize();
+    if (args == 1) {
+        ARG(malInteger, value);
+        MAL_CHECK(value->value() > 0, "Buffer size must be positive");
+        console.setBufferSize(value->value());
+    }
+    return mal::integer(size);
+}
+
 BUILTIN("polar")
 {
     CHECK_ARGS_IS(3);
@@ -1480,527 +1910,102 @@ BUILTIN("pr-str")
 
 BUILTIN("prin1")
 {
-    int args = CHECK_ARGS_BETWEEN(0, 2);
-    if (args == 0) {
-        std::cout << std::endl;
-        return mal::nullValue();
-    }
-    malFile* pf = NULL;
-    MALTYPE type = argsBegin->ptr()->type();
-    String boolean = argsBegin->ptr()->print(true);
-    malValueIter value = argsBegin;
+    return printForm(name, argsBegin, argsEnd, "\"", "\"");
+}
 
-    if (args == 2) {
-        argsBegin++;
-        if (argsBegin->ptr()->print(true).compare("nil") != 0) {
-            pf = VALUE_CAST(malFile, *argsBegin);
-        }
-    }
-    if (boolean == "nil") {
-        if (pf) {
-            pf->writeLine("\"nil\"");
-        }
-        else {
-            std::cout << "\"nil\"";
-        }
-            return mal::nilValue();
-    }
-    if (boolean == "false") {
-        if (pf) {
-            pf->writeLine("\"false\"");
-        }
-        else {
-            std::cout << "\"false\"";
-        }
-            return mal::falseValue();
-    }
-    if (boolean == "true") {
-        if (pf) {
-            pf->writeLine("\"true\"");
-        }
-        else {
-            std::cout << "\"true\"";
-        }
-            return mal::trueValue();
+BUILTIN("princ")
+{
+    return printForm(name, argsBegin, argsEnd, "", "");
+}
+
+BUILTIN("print")
+{
+    return printForm(name, argsBegin, argsEnd, "\n\"", "\" ");
+}
+
+BUILTIN("println")
+{
+    malPrinter out(malOutputPort::console());
+    out.limitBy(s_coreEnv);
+    printValues(out, argsBegin, argsEnd, " ", false);
+    out.write('\n');
+    return mal::nilValue();
+}
+
+BUILTIN("prn")
+{
+    malPrinter out(malOutputPort::console());
+    out.limitBy(s_coreEnv);
+    printValues(out, argsBegin, argsEnd, " ", true);
+    out.write('\n');
+    return mal::nilValue();
+}
+
+BUILTIN("process")
+{
+    // (process command [options]), command being a list of its words or
+    // a string as startapp takes it. options maps :stdin, :stdout and
+    // :stderr to :pipe, :inherit or :null, by default :null, :pipe and
+    // :inherit.
+    int args = CHECK_ARGS_BETWEEN(1, 2);
+    StringVec argv = commandOf(*argsBegin++);
+    const malHash* options = NULL;
+    if (args > 1 && !NIL_PTR) {
+        ARG(malHash, map);
+        options = map;
     }
-    if (boolean == "T") {
-        if (pf) {
-            pf->writeLine("\"T\"");
-        }
-        else {
-            std::cout << "\"T\"";
-        }
-            return mal::trueValue();
+    return malValuePtr(new malProcess(argv,
+        streamOption(options, ":stdin", malProcess::DISCARD),
+        streamOption(options, ":stdout", malProcess::PIPE),
+        streamOption(options, ":stderr", malProcess::INHERIT)));
+}
+
+BUILTIN("process-pid")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malProcess, process);
+    return mal::integer(process->pid());
+}
+
+BUILTIN("process-stderr")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malProcess, process);
+    return process->errors();
+}
+
+BUILTIN("process-stdin")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malProcess, process);
+    return process->input();
+}
+
+BUILTIN("process-stdout")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malProcess, process);
+    return process->output();
+}
+
+BUILTIN("process-wait")
+{
+    // (process-wait process [timeout]): its exit status, or nil if it is
+    // still running after timeout milliseconds. Waits for ever without.
+    int args = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malProcess, process);
+    int timeout = -1;
+    if (args > 1) {
+        AG_INT(milliseconds);
+        timeout = std::max<int64_t>(0, milliseconds->value());
     }
-
-    switch(type) {
-        case MALTYPE::FILE: {
-            malFile* f = VALUE_CAST(malFile, *value);
-            char filePtr[32];
-            sprintf(filePtr, "%p", f->value());
-            const String file = filePtr;
-            if (pf) {
-                pf->writeLine("\"" + file + "\"");
-            }
-            else {
-                std::cout << "\"" << file << "\"";
-            }
-            return f;
-        }
-        case MALTYPE::INT: {
-            malInteger* i = VALUE_CAST(malInteger, *value);
-            if (pf) {
-                pf->writeLine("\"" + i->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << i->print(true) << "\"";
-            }
-            return i;
-        }
-        case MALTYPE::LIST: {
-            malList* list = VALUE_CAST(malList, *value);
-            if (pf) {
-                pf->writeLine("\"" + list->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << list->print(true) << "\"";
-            }
-            return list;
-        }
-        case MALTYPE::MAP: {
-            malHash* hash = VALUE_CAST(malHash, *value);
-            if (pf) {
-                pf->writeLine("\"" + hash->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << hash->print(true) << "\"";
-            }
-            return hash;
-         }
-        case MALTYPE::REAL: {
-            malDouble* d = VALUE_CAST(malDouble, *value);
-            if (pf) {
-                pf->writeLine("\"" + d->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << d->print(true) << "\"";
-            }
-            return d;
-        }
-        case MALTYPE::STR: {
-            malString* str = VALUE_CAST(malString, *value);
-            if (pf) {
-                pf->writeLine("\"" + str->value() + "\"");
-            }
-            else {
-                std::cout << "\"" << str->value() << "\"";
-            }
-            return str;
-        }
-        case MALTYPE::SYM: {
-            malSymbol* sym = VALUE_CAST(malSymbol, *value);
-            if (pf) {
-                pf->writeLine("\"" + sym->value() + "\"");
-            }
-            else {
-                std::cout << "\"" << sym->value() << "\"";
-            }
-            return sym;
-        }
-        case MALTYPE::VEC: {
-            malVector* vector = VALUE_CAST(malVector, *value);
-            if (pf) {
-                pf->writeLine("\"" + vector->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << vector->print(true) << "\"";
-            }
-            return vector;
-        }
-        case MALTYPE::KEYW: {
-            malKeyword* keyword = VALUE_CAST(malKeyword, *value);
-            if (pf) {
-                pf->writeLine("\"" + keyword->print(true) + "\"");
-            }
-            else {
-                std::cout << "\"" << keyword->print(true) << "\"";
-            }
-            return keyword;
-        }
-        default: {
-            if (pf) {
-                pf->writeLine("\"nil\"");
-            }
-            else {
-                std::cout << "\"nil\"";
-            }
-            return mal::nilValue();
-        }
-    }
-
-    if (pf) {
-        pf->writeLine("\"nil\"");
-    }
-    else {
-        std::cout << "\"nil\"";
-    }
-        return mal::nilValue();
-}
-
-BUILTIN("princ")
-{
-    int args = CHECK_ARGS_BETWEEN(0, 2);
-    if (args == 0) {
-        std::cout << std::endl;
-        return mal::nullValue();
-    }
-    malFile* pf = NULL;
-    MALTYPE type = argsBegin->ptr()->type();
-    String boolean = argsBegin->ptr()->print(true);
-    malValueIter value = argsBegin;
-
-    if (args == 2) {
-        argsBegin++;
-        if (argsBegin->ptr()->print(true).compare("nil") != 0) {
-            pf = VALUE_CAST(malFile, *argsBegin);
-        }
-    }
-    if (boolean == "nil") {
-        if (pf) {
-            pf->writeLine("nil");
-        }
-        else {
-            std::cout << "nil";
-        }
-            return mal::nilValue();
-    }
-    if (boolean == "false") {
-        if (pf) {
-            pf->writeLine("false");
-        }
-        else {
-            std::cout << "false";
-        }
-            return mal::falseValue();
-    }
-    if (boolean == "true") {
-        if (pf) {
-            pf->writeLine("true");
-        }
-        else {
-            std::cout << "true";
-        }
-            return mal::trueValue();
-    }
-    if (boolean == "T") {
-        if (pf) {
-            pf->writeLine("T");
-        }
-        else {
-            std::cout << "T";
-        }
-            return mal::trueValue();
-    }
-
-    switch(type) {
-        case MALTYPE::FILE: {
-            malFile* f = VALUE_CAST(malFile, *value);
-            char filePtr[32];
-            sprintf(filePtr, "%p", f->value());
-            const String file = filePtr;
-            if (pf) {
-                pf->writeLine(file);
-            }
-            else {
-                std::cout << file;
-            }
-            return f;
-        }
-        case MALTYPE::INT: {
-            malInteger* i = VALUE_CAST(malInteger, *value);
-            if (pf) {
-                pf->writeLine(i->print(true));
-            }
-            else {
-                std::cout << i->print(true);
-            }
-            return i;
-        }
-        case MALTYPE::LIST: {
-            malList* list = VALUE_CAST(malList, *value);
-            if (pf) {
-                pf->writeLine(list->print(true));
-            }
-            else {
-                std::cout << list->print(true);
-            }
-            return list;
-        }
-        case MALTYPE::MAP: {
-            malHash* hash = VALUE_CAST(malHash, *value);
-            if (pf) {
-                pf->writeLine(hash->print(true));
-            }
-            else {
-                std::cout << hash->print(true);
-            }
-            return hash;
-         }
-        case MALTYPE::REAL: {
-            malDouble* d = VALUE_CAST(malDouble, *value);
-            if (pf) {
-                pf->writeLine(d->print(true));
-            }
-            else {
-                std::cout << d->print(true);
-            }
-            return d;
-        }
-        case MALTYPE::STR: {
-            malString* str = VALUE_CAST(malString, *value);
-            if (pf) {
-                pf->writeLine(str->value());
-            }
-            else {
-                std::cout << str->value();
-            }
-            return str;
-        }
-        case MALTYPE::SYM: {
-            malSymbol* sym = VALUE_CAST(malSymbol, *value);
-            if (pf) {
-                pf->writeLine(sym->value());
-            }
-            else {
-                std::cout << sym->value();
-            }
-            return sym;
-        }
-        case MALTYPE::VEC: {
-            malVector* vector = VALUE_CAST(malVector, *value);
-            if (pf) {
-                pf->writeLine(vector->print(true));
-            }
-            else {
-                std::cout << vector->print(true);
-            }
-            return vector;
-        }
-        case MALTYPE::KEYW: {
-            malKeyword* keyword = VALUE_CAST(malKeyword, *value);
-            if (pf) {
-                pf->writeLine(keyword->print(true));
-            }
-            else {
-                std::cout << keyword->print(true);
-            }
-            return keyword;
-        }
-        default: {
-            if (pf) {
-                pf->writeLine("nil");
-            }
-            else {
-                std::cout << "nil";
-            }
-            return mal::nilValue();
-        }
-    }
-
-    if (pf) {
-        pf->writeLine("nil");
-    }
-    else {
-        std::cout << "nil";
-    }
-        return mal::nilValue();
-}
-
-BUILTIN("print")
-{
-    int args = CHECK_ARGS_BETWEEN(0, 2);
-    if (args == 0) {
-        std::cout << std::endl;
-        return mal::nullValue();
-    }
-    malFile* pf = NULL;
-    MALTYPE type = argsBegin->ptr()->type();
-    String boolean = argsBegin->ptr()->print(true);
-    malValueIter value = argsBegin;
-
-    if (args == 2) {
-        argsBegin++;
-        if (argsBegin->ptr()->print(true).compare("nil") != 0) {
-            pf = VALUE_CAST(malFile, *argsBegin);
-        }
-    }
-    if (boolean == "nil") {
-        if (pf) {
-            pf->writeLine("\n\"nil\" ");
-        }
-        else {
-            std::cout << "\n\"nil\" ";
-        }
-            return mal::nilValue();
-    }
-    if (boolean == "false") {
-        if (pf) {
-            pf->writeLine("\n\"false\" ");
-        }
-        else {
-            std::cout << "\n\"false\" ";
-        }
-            return mal::falseValue();
-    }
-    if (boolean == "true") {
-        if (pf) {
-            pf->writeLine("\n\"true\" ");
-        }
-        else {
-            std::cout << "\n\"true\" ";
-        }
-            return mal::trueValue();
-    }
-    if (boolean == "T") {
-        if (pf) {
-            pf->writeLine("\n\"T\" ");
-        }
-        else {
-            std::cout << "\n\"T\" ";
-        }
-            return mal::trueValue();
-    }
-
-    switch(type) {
-        case MALTYPE::FILE: {
-            malFile* f = VALUE_CAST(malFile, *value);
-            char filePtr[32];
-            sprintf(filePtr, "%p", f->value());
-            const String file = filePtr;
-            if (pf) {
-                pf->writeLine("\n\"" + file + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << file << "\" ";
-            }
-            return f;
-        }
-        case MALTYPE::INT: {
-            malInteger* i = VALUE_CAST(malInteger, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + i->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << i->print(true) << "\" ";
-            }
-            return i;
-        }
-        case MALTYPE::LIST: {
-            malList* list = VALUE_CAST(malList, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + list->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << list->print(true) << "\" ";
-            }
-            return list;
-        }
-        case MALTYPE::MAP: {
-            malHash* hash = VALUE_CAST(malHash, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + hash->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << hash->print(true) << "\" ";
-            }
-            return hash;
-         }
-        case MALTYPE::REAL: {
-            malDouble* d = VALUE_CAST(malDouble, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + d->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << d->print(true) << "\" ";
-            }
-            return d;
-        }
-        case MALTYPE::STR: {
-            malString* str = VALUE_CAST(malString, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + str->value() + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << str->value() << "\" ";
-            }
-            return str;
-        }
-        case MALTYPE::SYM: {
-            malSymbol* sym = VALUE_CAST(malSymbol, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + sym->value() + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << sym->value() << "\" ";
-            }
-            return sym;
-        }
-        case MALTYPE::VEC: {
-            malVector* vector = VALUE_CAST(malVector, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + vector->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << vector->print(true) << "\" ";
-            }
-            return vector;
-        }
-        case MALTYPE::KEYW: {
-            malKeyword* keyword = VALUE_CAST(malKeyword, *value);
-            if (pf) {
-                pf->writeLine("\n\"" + keyword->print(true) + "\" ");
-            }
-            else {
-                std::cout << "\n\"" << keyword->print(true) << "\" ";
-            }
-            return keyword;
-        }
-        default: {
-            if (pf) {
-                pf->writeLine("\n\"nil\" ");
-            }
-            else {
-                std::cout << "\n\"nil\" ";
-            }
-            return mal::nilValue();
-        }
-    }
-
-    if (pf) {
-        pf->writeLine("\n\"nil\" ");
-    }
-    else {
-        std::cout << "\n\"nil\" ";
-    }
-        return mal::nilValue();
-}
-
-BUILTIN("println")
-{
-    std::cout << printValues(argsBegin, argsEnd, " ", false) << std::endl;
-    return mal::nilValue();
-}
-
-BUILTIN("prn")
-{
-    std::cout << printValues(argsBegin, argsEnd, " ", true) << std::endl;
-    return mal::nilValue();
-}
+    return process->wait(timeout);
+}
 
 BUILTIN("prompt")
 {
     ARG(malString, str);
-    std::cout << str->value();
+    malOutputPort::console().write(str->view());
     return mal::nilValue();
 }
 
@@ -2012,17 +2017,70 @@ BUILTIN("read-string")
     return readStr(str->value());
 }
 
+BUILTIN("read-data")
+{
+    // Like read-string, for data only: numbers, strings, keywords, lists,
+    // vectors, maps, nil, true and false. Much faster on big inputs.
+    CHECK_ARGS_IS(1);
+    ARG(malString, str);
+
+    return readData(str->view());
+}
+
 BUILTIN("read-line")
 {
-    if (!CHECK_ARGS_AT_LEAST(0))
+    // (read-line file T) leaves the line terminator off.
+    int args = CHECK_ARGS_BETWEEN(0, 2);
+    if (args == 0)
     {
         String str;
+        malOutputPort::console().flush();
         std::getline(std::cin, str);
         return mal::string(str);
     }
     ARG(malFile, pf);
+    bool stripTerminator = args == 2 && (*argsBegin)->isTrue();
+
+    return pf->readLine(stripTerminator);
+}
+
+BUILTIN("read-lines")
+{
+    // The lines of the file at path, which stays open until the last
+    // one has been read.
+    CHECK_ARGS_IS(1);
+    ARG(malString, path);
+    malValuePtr file = mal::file(path->value().c_str(), 'r');
+    MAL_CHECK(STATIC_CAST(malFile, file)->open() != mal::nilValue(),
+              "Cannot open %s", path->value().c_str());
+    return mal::lineSeq(file, true);
+}
 
-    return pf->readLine();
+BUILTIN("read-bytes")
+{
+    // Up to count bytes, or the rest of the file. nil at its end.
+    int args = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malFile, pf);
+    MAL_CHECK(pf->isOpen(), "i/o file is closed");
+    if (args == 2) {
+        AG_INT(count);
+        MAL_CHECK(count->value() >= 0, "Size must not be negative");
+        malValuePtr result = mal::bytes(count->value());
+        std::vector<uint8_t>& data = STATIC_CAST(malBytes, result)->data();
+        data.resize(pf->readBytes((char*)data.data(), data.size()));
+        return data.empty() && count->value() > 0 ? mal::nilValue() : result;
+    }
+    malValuePtr result = mal::bytes(0);
+    std::vector<uint8_t>& data = STATIC_CAST(malBytes, result)->data();
+    const size_t CHUNK_SIZE = 64 * 1024;
+    size_t count;
+    do {
+        size_t size = data.size();
+        data.resize(size + CHUNK_SIZE);
+        count = pf->readBytes((char*)data.data() + size, CHUNK_SIZE);
+        data.resize(size + count);
+    } while (count == CHUNK_SIZE);
+    return data.empty() ? mal::nilValue() : result;
 }
 
 BUILTIN("read-char")
@@ -2032,11 +2090,11 @@ BUILTIN("read-char")
         unsigned char c = 0;
         while (! kbhit())
         {
-            fflush(stdout);
+            malOutputPort::console().flush();
             c=getchar();
             break;
         }
-        std::cout << std::endl;
+        malOutputPort::console().write("\n");
         return mal::integer(int(c));
     }
     ARG(malFile, pf);
@@ -2052,6 +2110,20 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("refcount-stats")
+{
+    CHECK_ARGS_IS(0);
+#if DEBUG_REFCOUNT_STATS
+    malHash::Map map;
+    map[":acquires"] = mal::integer(RefCounted::s_acquires);
+    map[":releases"] = mal::integer(RefCounted::s_releases);
+    return mal::hash(map);
+#else
+    // Only counted in builds with DEBUG_REFCOUNT_STATS set.
+    return mal::nilValue();
+#endif
+}
+
 BUILTIN("rem")
 {
     CHECK_ARGS_AT_LEAST(2);
@@ -2125,6 +2197,27 @@ BUILTIN("reverse")
     return seq->reverse(seq->begin(), seq->end());
 }
 
+BUILTIN("run-parallel")
+{
+    // (run-parallel commands [jobs]): runs each command as process takes
+    // it, jobs at a time, one per CPU by default, sharing our streams.
+    // Their exit statuses, nil for any that couldn't be started.
+    int args = CHECK_ARGS_BETWEEN(1, 2);
+    ARG(malSequence, commands);
+    int jobs = std::max(1u, std::thread::hardware_concurrency());
+    if (args > 1) {
+        AG_INT(count);
+        MAL_CHECK(count->value() > 0, "Bad job count %lld",
+                  (long long)count->value());
+        jobs = std::min<int64_t>(count->value(), 1024);
+    }
+    std::vector<StringVec> argvs;
+    for (const auto& command : *commands) {
+        argvs.push_back(commandOf(command));
+    }
+    return malProcess::runParallel(argvs, jobs);
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -2161,18 +2254,11 @@ BUILTIN("slurp")
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
 
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
-
-    return mal::string(data);
+    // Big files are mapped rather than read, the string keeps them mapped.
+    if (malStringBuffer* mapped = malStringBuffer::map(filename->value())) {
+        return mal::string(mapped);
+    }
+    return mal::string(readFile(filename->value()));
 }
 
 BUILTIN("sqrt")
@@ -2193,7 +2279,10 @@ BUILTIN("startapp")
         command += para->value();
     }
 
-    if (system(command.c_str()))
+    // Straight to the program, unless the command needs the shell. One
+    // that can't be started fails as one that exits non-zero does.
+    malValuePtr status = malProcess::run(malProcess::commandArgv(command));
+    if (!status->isEqualTo(mal::integer(0).ptr()))
     {
         return mal::nilValue();
     }
@@ -2202,7 +2291,7 @@ BUILTIN("startapp")
 
 BUILTIN("str")
 {
-    return mal::string(printValues(argsBegin, argsEnd, "", false));
+    return joinValues(argsBegin, argsEnd);
 }
 
 BUILTIN("strcase")
@@ -2228,6 +2317,47 @@ BUILTIN("strcase")
     return mal::string(trans);
 }
 
+BUILTIN("string-builder")
+{
+    malValuePtr builder = mal::stringBuilder();
+    String& text = STATIC_CAST(malStringBuilder, builder)->text();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        appendText(text, *it);
+    }
+    return builder;
+}
+
+BUILTIN("string-compact")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, s);
+    // A short part of a large string keeps all of it alive, so give it
+    // a buffer of its own.
+    if (s->isPinning()) {
+        return mal::string(s->view());
+    }
+    return malValuePtr(s);
+}
+
+BUILTIN("string-split")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malString, s);
+    ARG(malString, separator);
+    std::string_view text = s->view();
+    std::string_view sep = separator->view();
+    MAL_CHECK(!sep.empty(), "Separator must not be empty");
+
+    malValueVec* items = new malValueVec;
+    size_t pos = 0;
+    for (size_t next; (next = text.find(sep, pos)) != text.npos;
+         pos = next + sep.size()) {
+        items->push_back(s->substr(pos, next - pos));
+    }
+    items->push_back(s->substr(pos, text.size() - pos));
+    return mal::list(items);
+}
+
 BUILTIN("strlen")
 {
     return mal::integer(countValues(argsBegin, argsEnd));
@@ -2238,27 +2368,16 @@ BUILTIN("substr")
     int count = CHECK_ARGS_AT_LEAST(2);
     ARG(malString, s);
     AG_INT(start);
-    int startPos = (int)start->value();
+    MAL_CHECK(start->value() > 0, "Index out of range");
 
-    if (s)
+    size_t length = String::npos;
+    if (count > 2)
     {
-        String bla = s->value();
-        if (startPos > (int)bla.size()+1) {
-            startPos = (int)bla.size()+1;
-        }
-
-        if (count > 2)
-        {
-            AG_INT(size);
-            return mal::string(bla.substr(startPos-1, size->value()));
-        }
-        else
-        {
-                return mal::string(bla.substr(startPos-1, bla.size()));
-        }
+        AG_INT(size);
+        length = size->value();
     }
-
-    return mal::string(String(""));
+    // Shares the text of s, unless the result is short.
+    return s->substr(start->value() - 1, length);
 }
 
 BUILTIN("subst")
@@ -2310,7 +2429,7 @@ BUILTIN("tan")
 
 BUILTIN("terpri")
 {
-    std::cout << std::endl;
+    malOutputPort::console().write("\n");
     return mal::nilValue();
 }
 
@@ -2343,6 +2462,37 @@ BUILTIN("type?")
     return mal::type(argsBegin->ptr()->type());
 }
 
+BUILTIN("unix-accept")
+{
+    // The next connection to a socket from unix-listen, waiting for one
+    // unless the socket is readable.
+    CHECK_ARGS_IS(1);
+    ARG(malFile, listener);
+    MAL_CHECK(listener->isOpen(), "i/o file is closed");
+    int fd;
+    while ((fd = accept4(fileno(listener->value()), NULL, NULL,
+                         SOCK_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    MAL_CHECK(fd >= 0, "Cannot accept: %s", strerror(errno));
+    return socketFile(fd, listener->print(false));
+}
+
+BUILTIN("unix-connect")
+{
+    // A file both read from and written to, unbuffered.
+    CHECK_ARGS_IS(1);
+    ARG(malString, path);
+    return unixSocket(path->value(), false);
+}
+
+BUILTIN("unix-listen")
+{
+    // A socket at path, readable when there is a connection to accept.
+    CHECK_ARGS_IS(1);
+    ARG(malString, path);
+    return unixSocket(path->value(), true);
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
@@ -2380,133 +2530,55 @@ BUILTIN("vl-consp")
 
 BUILTIN("vl-directory-files")
 {
-    int count = CHECK_ARGS_AT_LEAST(0);
-    int len = 0;
+    // (vl-directory-files [directory [pattern [directories [recursive]]]])
+    // with directories -1 for directories only, 0 for everything and 1,
+    // the default, for files only. Recursive lists the whole tree, as
+    // paths relative to directory. Sorted in natural order.
+    int args = CHECK_ARGS_BETWEEN(0, 4);
     String path = "./";
-    malValueVec* items;
-    std::vector<std::filesystem::path> sorted_by_name;
-
-    if (count > 0) {
-        std::cout << "count > 0" << std::endl;
+    String pattern;
+    int kinds = malDirectoryWalker::FILES;
+    bool isRecursive = false;
+    if (args > 0 && !NIL_PTR) {
         ARG(malString, directory);
         path = directory->value();
-        if (!std::filesystem::exists(path.c_str())) {
-            return mal::nilValue();
-        }
-        if (count > 1 && (NIL_PTR || INT_PTR) && !(count == 2 && (NIL_PTR || INT_PTR))) {
-            std::cout << "count > 1 && NIL_PTR" << std::endl;
-            if (NIL_PTR) {
-                argsBegin++;
-            }
-            // pattern + dirs
-            AG_INT(directories);
-            switch(directories->value())
-            {
-                case -1:
-                    for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-                        if (std::filesystem::is_directory(entry.path()))
-                        {
-                            sorted_by_name.push_back(entry.path().filename());
-                            len++;
-                        }
-                    }
-                    break;
-                case 0:
-                    for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-                        sorted_by_name.push_back(entry.path());
-                        len++;
-                    }
-                    break;
-                case 1:
-                    for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-                        if (!std::filesystem::is_directory(entry.path()))
-                        {
-                            sorted_by_name.push_back(entry.path().filename());
-                            len++;
-                        }
-                    }
-                    break;
-                default: {}
-            }
-        }
-        else if (count > 1 && !(count == 2 && (NIL_PTR || INT_PTR))) {
-            std::cout << "count > 1 && !(count == 2 && (NIL_PTR || INT_PTR))" << std::endl;
-            ARG(malString, pattern);
-            int dir = 3;
-            if (count > 2) {
-                AG_INT(directories2);
-                dir = directories2->value();
-                if (dir > 1 || dir < -1) {
-                    dir = 0;
-                }
-            }
-            // pattern
-            bool hasExt = false;
-            bool hasName = false;
-            String pat = pattern->value();
-            int asterix = (int) pat.find_last_of("*");
-            if (asterix != -1 && (int) pat.size() >= asterix) {
-                hasExt = true;
-            }
-            if (asterix != -1 && (int) pat.size() >= asterix && pat.size() > pat.substr(asterix+1).size() ) {
-                hasName = true;
-            }
-            for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-                if (!std::filesystem::is_directory(entry.path()) &&
-                    hasExt &&
-                    hasName &&
-                    (dir == 3 || dir == 1)) {
-                    if ((int)entry.path().filename().string().find(pat.substr(asterix+1)) != -1 &&
-                        (int)entry.path().filename().string().find(pat.substr(0, asterix)) != -1) {
-                        sorted_by_name.push_back(entry.path().filename());
-                        len++;
-                    }
-                }
-                if (!std::filesystem::is_directory(entry.path()) && !hasExt &&
-                    (int)entry.path().filename().string().find(pat) != -1 && (dir == 3 || dir == 1)) {
-                    sorted_by_name.push_back(entry.path().filename());
-                    len++;
-                }
-                if (std::filesystem::is_directory(entry.path()) && !hasExt &&
-                    (int)entry.path().filename().string().find(pat) != -1  && dir == -1) {
-                    sorted_by_name.push_back(entry.path().filename());
-                    len++;
-                }
-                if ((int)entry.path().string().find(pat) != -1 && dir == 0) {
-                    sorted_by_name.push_back(entry.path());
-                    len++;
-                }
-            }
-        }
-        else {
-            std::cout << "else directory" << std::endl;
-            // directory
-            for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-                if (!std::filesystem::is_directory(entry.path()))
-                {
-                    sorted_by_name.push_back(entry.path().filename());
-                    len++;
-                }
-            }
-        }
     }
-    else {
-        std::cout << "else current directory" << std::endl;
-        // current directory
-        for (const auto & entry : std::filesystem::directory_iterator(path.c_str())) {
-            if (!std::filesystem::is_directory(entry.path()))
-            {
-                sorted_by_name.push_back(entry.path().filename());
-                len++;
-            }
+    else if (args > 0) {
+        argsBegin++;
+    }
+    if (args > 1 && !NIL_PTR) {
+        ARG(malString, wildcard);
+        pattern = wildcard->value();
+    }
+    else if (args > 1) {
+        argsBegin++;
+    }
+    if (args > 2 && !NIL_PTR) {
+        AG_INT(directories);
+        kinds = directories->value();
+        if (kinds > 1 || kinds < -1) {
+            kinds = malDirectoryWalker::ALL;
         }
     }
-    std::sort(sorted_by_name.begin(), sorted_by_name.end(), compareNat);
-    items = new malValueVec(len);
-    len = 0;
-    for (const auto & filename : sorted_by_name) {
-        items->at(len) = mal::string(filename);
-        len++;
+    else if (args > 2) {
+        argsBegin++;
+    }
+    if (args > 3) {
+        isRecursive = (*argsBegin)->isTrue();
+    }
+    if (!malFileCache::lookup(path).isDirectory) {
+        return mal::nilValue();
+    }
+
+    std::vector<String> paths;
+    malDirectoryWalker walker(path, pattern, kinds, isRecursive);
+    for (String found; walker.next(found); ) {
+        paths.push_back(std::move(found));
+    }
+    std::sort(paths.begin(), paths.end(), compareNatural);
+    malValueVec* items = new malValueVec(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        (*items)[i] = mal::string(paths[i]);
     }
     return items->size() ? mal::list(items) : mal::nilValue();
 }
@@ -2516,6 +2588,7 @@ BUILTIN("vl-file-copy")
     int count = CHECK_ARGS_AT_LEAST(2);
     ARG(malString, source);
     ARG(malString, dest);
+    malFileCache::invalidate(dest->value());
 
     if (count == 3 && argsBegin->ptr()->isTrue()) {
 
@@ -2559,6 +2632,7 @@ BUILTIN("vl-file-delete")
     if (!std::filesystem::exists(path->value().c_str())) {
         return mal::nilValue();
     }
+    malFileCache::invalidate(path->value());
     if (std::filesystem::remove(path->value().c_str()))
     {
         return mal::trueValue();
@@ -2570,9 +2644,7 @@ BUILTIN("vl-file-directory-p")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, path);
-    const std::filesystem::directory_entry dir(path->value().c_str());
-    if (std::filesystem::exists(path->value().c_str()) &&
-        dir.is_directory()) {
+    if (malFileCache::lookup(path->value()).isDirectory) {
         return mal::trueValue();
     }
     return mal::nilValue();
@@ -2588,6 +2660,8 @@ BUILTIN("vl-file-rename")
     }
     std::error_code err;
     std::filesystem::rename(path->value().c_str(), newName->value().c_str(), err);
+    malFileCache::invalidate(path->value());
+    malFileCache::invalidate(newName->value());
     if (err) {
         return mal::nilValue();
     }
@@ -2598,32 +2672,26 @@ BUILTIN("vl-file-size")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, path);
-    if (!std::filesystem::exists(path->value().c_str())) {
+    malFileInfo info = malFileCache::lookup(path->value());
+    if (!info.exists) {
         return mal::nilValue();
     }
-    if (!std::filesystem::is_directory(path->value().c_str())) {
+    if (info.isDirectory) {
         return mal::string("0");
     }
-    try {
-        [[maybe_unused]] auto size = std::filesystem::file_size(path->value().c_str());
-        char str[50];
-        sprintf(str, "%ld", size);
-        return mal::string(str);
-    }
-    catch (std::filesystem::filesystem_error&) {}
-    return mal::nilValue();
+    return mal::string(std::to_string(info.size));
 }
 
 BUILTIN("vl-file-systime")
 {
     CHECK_ARGS_IS(1);
     ARG(malString, path);
-    if (!std::filesystem::exists(path->value().c_str())) {
+    malFileInfo info = malFileCache::lookup(path->value());
+    if (!info.exists) {
         return mal::nilValue();
     }
 
-    std::filesystem::file_time_type ftime = std::filesystem::last_write_time(path->value().c_str());
-    std::time_t cftime = to_time_t(ftime); // assuming system_clock
+    std::time_t cftime = info.modified;
 
     char buffer[64];
     int J,M,W,D,h,m,s;
@@ -2649,7 +2717,7 @@ BUILTIN("vl-filename-base")
     ARG(malString, path);
 
     const std::filesystem::path p(path->value());
-    return mal::string(p.stem());
+    return mal::string(p.stem().string());
 }
 
 BUILTIN("vl-filename-directory")
@@ -2676,7 +2744,7 @@ BUILTIN("vl-filename-extension")
         return mal::nilValue();
     }
 
-    return mal::string(p.extension());
+    return mal::string(p.extension().string());
 }
 
 BUILTIN("vl-filename-mktemp")
@@ -2725,6 +2793,7 @@ BUILTIN("vl-mkdir")
     CHECK_ARGS_IS(1);
     ARG(malString, dir);
 
+    malFileCache::invalidate(dir->value());
     if(std::filesystem::create_directory(dir->value())) {
         return mal::trueValue();
     }
@@ -2758,76 +2827,9 @@ BUILTIN("wcmatch")
 {
     CHECK_ARGS_IS(2);
     ARG(malString, str);
-    ARG(malString, p);
-    std::vector<String> StringList;
-    String del = ",";
-    String pat = p->value();
-    auto pos = pat.find(del);
-
-    while (pos != String::npos) {
-        StringList.push_back(pat.substr(0, pos));
-        pat.erase(0, pos + del.length());
-        pos = pat.find(del);
-    }
-    StringList.push_back(pat);
-    for (auto &it : StringList) {
-        String pattern = it;
-        String expr = "";
-        bool exclude = false;
-        bool open_br = false;
-        for (auto &ch : it) {
-            switch (ch) {
-                case '#':
-                    expr += "(\\d)";
-                    break;
-                case '@':
-                    expr += "[A-Za-zÀ-ȕ]";
-                    break;
-                case ' ':
-                    expr += "[ ]+";
-                    break;
-                case '.':
-                    expr += "([^(A-Za-z0-9 )]{1,})";
-                    break;
-                case '*':
-                    expr += "(.*)";
-                    break;
-                case '?':
-                    expr += "[A-Za-zÀ-ȕ0-9_ ]";
-                    break;
-                case '~': {
-                    if (open_br) {
-                        expr += "^";
-                    } else {
-                        expr += "[^";
-                    exclude = true;
-                    }
-                    break;
-                }
-                case '[':
-                    expr += "[";
-                    open_br = true;
-                    break;
-                case ']': {
-                    expr += "]{1}";
-                    open_br = false;
-                    break;
-                }
-                case '`':
-                    expr += "//";
-                    break;
-                default: {
-                    expr += ch;
-                }
-            }
-        }
-        if (exclude) {
-            expr += "]*";
-        }
-        std::regex e (expr);
-        if (std::regex_match (str->value(),e)) {
-            return mal::trueValue();
-        }
+    ARG(malString, pattern);
+    if (malWildcard::compiled(pattern->view()).matches(str->view())) {
+        return mal::trueValue();
     }
     return mal::nilValue();
 }
@@ -2840,19 +2842,38 @@ BUILTIN("with-meta")
     return obj->withMeta(meta);
 }
 
+BUILTIN("write-bytes")
+{
+    // Writes bytes, or the bytes of a string, returning how many.
+    CHECK_ARGS_IS(2);
+    ARG(malFile, pf);
+    std::string_view bytes;
+    if (const malBytes* b = DYNAMIC_CAST(malBytes, *argsBegin)) {
+        bytes = b->view();
+    }
+    else {
+        bytes = VALUE_CAST(malString, *argsBegin)->view();
+    }
+    MAL_CHECK(pf->isOpen(), "i/o file is closed");
+    pf->writeBytes(bytes);
+    return mal::integer(bytes.size());
+}
+
 BUILTIN("write-line")
 {
     int count = CHECK_ARGS_AT_LEAST(1);
-    ARG(malString, str);
+    malValuePtr line = *argsBegin++;
+    std::string_view text = textOf(line);
 
     if (count == 1)
     {
-        return mal::string(str->value());
+        return mal::string(text);
     }
 
     ARG(malFile, pf);
 
-    return pf->writeLine(str->value());
+    pf->writeLine(text);
+    return line;
 }
 
 BUILTIN("write-char")
@@ -2860,7 +2881,8 @@ BUILTIN("write-char")
     int count = CHECK_ARGS_AT_LEAST(1);
     AG_INT(c);
 
-    std::cout << itoa64(c->value()) << std::endl;
+    malOutputPort::console().write(itoa64(c->value()));
+    malOutputPort::console().write("\n");
 
     if (count == 1)
     {
@@ -2873,42 +2895,369 @@ BUILTIN("write-char")
 }
 
 void installCore(malEnvPtr env) {
+    s_coreEnv = env.ptr();
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
         env->set(handler->name(), handler);
     }
 }
 
+static void printValues(malPrinter& out, malValueIter begin, malValueIter end,
+                        std::string_view sep, bool readably)
+{
+    for (auto it = begin; it != end; ++it) {
+        if (it != begin) {
+            out.write(sep);
+        }
+        out.print(*it, readably);
+    }
+}
+
 static String printValues(malValueIter begin, malValueIter end,
-                          const String& sep, bool readably)
+                          std::string_view sep, bool readably)
 {
     String out;
+    malPrinter printer(out);
+    printValues(printer, begin, end, sep, readably);
+    return out;
+}
 
-    if (begin != end) {
-        out += (*begin)->print(readably);
-        ++begin;
+// What str adds for value. Strings and builders go in without a copy
+// being made of them first.
+static void appendText(String& out, const malValuePtr& value)
+{
+    malPrinter(out).print(value, false);
+}
+
+static malValuePtr printForm(malPrinter& out, const malValuePtr& value)
+{
+    if (value == mal::nilValue() || value == mal::falseValue()
+        || value == mal::trueValue()) {
+        out.write(value->print(true));
+        return value;
+    }
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, value)) {
+        out.write(sym->value());
+        return sym->value() == "T" ? mal::trueValue() : value;
+    }
+    if (DYNAMIC_CAST(malStringBuilder, value)) {
+        out.print(value, false);
+        return value;
     }
 
-    for ( ; begin != end; ++begin) {
-        out += sep;
-        out += (*begin)->print(readably);
+    switch (value->type()) {
+        case MALTYPE::FILE: {
+            char filePtr[32];
+            snprintf(filePtr, sizeof(filePtr), "%p",
+                     STATIC_CAST(malFile, value)->value());
+            out.write(filePtr);
+            return value;
+        }
+        case MALTYPE::STR:
+            out.print(value, false);
+            return value;
+        case MALTYPE::INT:
+        case MALTYPE::LIST:
+        case MALTYPE::MAP:
+        case MALTYPE::REAL:
+        case MALTYPE::VEC:
+        case MALTYPE::KEYW:
+            out.print(value, true);
+            return value;
+        default:
+            out.write("nil");
+            return mal::nilValue();
+    }
+}
+
+// prin1, princ and print: the first argument goes between before and
+// after, on stdout or as a line of the file given as the second.
+static malValuePtr printForm(const String& name,
+                             malValueIter argsBegin, malValueIter argsEnd,
+                             std::string_view before, std::string_view after)
+{
+    int args = CHECK_ARGS_BETWEEN(0, 2);
+    if (args == 0) {
+        malOutputPort::console().write("\n");
+        return mal::nullValue();
     }
+    const malValuePtr& value = *argsBegin;
 
-    return out;
+    if (args == 2 && argsBegin[1] != mal::nilValue()) {
+        malFile* pf = VALUE_CAST(malFile, argsBegin[1]);
+        String line;
+        malValuePtr result;
+        {
+            malPrinter out(line);
+            out.limitBy(s_coreEnv);
+            out.write(before);
+            result = printForm(out, value);
+            out.write(after);
+        }
+        pf->writeLine(line);
+        return result;
+    }
+
+    malPrinter out(malOutputPort::console());
+    out.limitBy(s_coreEnv);
+    out.write(before);
+    malValuePtr result = printForm(out, value);
+    out.write(after);
+    return result;
 }
 
-static int countValues(malValueIter begin, malValueIter end)
+// Joining this much text or more makes a rope, so building up a long
+// string with (setq out (str out ...)) doesn't copy all of it each time.
+#define ROPE_MIN_LENGTH     256
+
+static malValuePtr joinValues(malValueIter begin, malValueIter end)
 {
-    int result = 0;
+    size_t length = 0;
+    for (auto it = begin; it != end; ++it) {
+        if (const malString* s = DYNAMIC_CAST(malString, *it)) {
+            length += s->length();
+        }
+    }
+    if (length < ROPE_MIN_LENGTH) {
+        return mal::string(printValues(begin, end, "", false));
+    }
 
-    if (begin != end) {
-        result += (*begin)->print(true).length() -2;
-        ++begin;
+    malValueVec pieces;
+    pieces.reserve(std::distance(begin, end));
+    length = 0;
+    for (auto it = begin; it != end; ++it) {
+        malValuePtr piece = *it;
+        if (!DYNAMIC_CAST(malString, piece)) {
+            String text;
+            appendText(text, piece);
+            piece = mal::string(text);
+        }
+        length += STATIC_CAST(malString, piece)->length();
+        pieces.push_back(piece);
     }
+    return mal::rope(std::move(pieces), length);
+}
+
+// The text of a string or a string builder.
+static std::string_view textOf(const malValuePtr& value)
+{
+    if (const malStringBuilder* b = DYNAMIC_CAST(malStringBuilder, value)) {
+        return b->view();
+    }
+    return VALUE_CAST(malString, value)->view();
+}
+
+static malValuePtr nthItem(malStream* stream, int64_t index)
+{
+    MAL_CHECK(index >= 0 && stream->skip(index) == index, "Index out of range");
+    malValuePtr item = stream->next();
+    MAL_CHECK(item != mal::nilValue(), "Index out of range");
+    return item;
+}
+
+static malValuePtr remainingItems(malStream* stream)
+{
+    malValueVec* items = new malValueVec;
+    for (malValuePtr item; (item = stream->next()) != mal::nilValue(); ) {
+        items->push_back(item);
+    }
+    return mal::list(items);
+}
+
+static int countValues(malValueIter begin, malValueIter end)
+{
+    int result = 0;
 
     for ( ; begin != end; ++begin) {
-        result += (*begin)->print(true).length() -2;
+        if (const malString* s = DYNAMIC_CAST(malString, *begin)) {
+            result += s->view().size();
+        }
+        else {
+            result += (*begin)->print(true).length() -2;
+        }
     }
 
     return result;
 }
+
+static String readFile(const String& path)
+{
+    ::FILE* file = fopen(path.c_str(), "rb");
+    MAL_CHECK(file, "Cannot open %s", path.c_str());
+
+    // Pipes and files under /proc have no size up front.
+    String data;
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+        data.reserve(st.st_size);
+    }
+    char chunk[64 * 1024];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, count);
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    MAL_CHECK(!failed, "Cannot read %s", path.c_str());
+    return data;
+}
+
+static BinaryField binaryField(const malKeyword* format)
+{
+    std::string_view name = format->view().substr(1);
+    BinaryField field = { 0, 0, false };
+    if (name.size() >= 2) {
+        field.kind = name[0];
+        name.remove_prefix(1);
+    }
+    if (name.size() > 2 && name.substr(name.size() - 2) == "be") {
+        field.isBigEndian = true;
+        name.remove_suffix(2);
+    }
+    else if (name.size() > 2 && name.substr(name.size() - 2) == "le") {
+        name.remove_suffix(2);
+    }
+    int bits = name == "8" ? 8 : name == "16" ? 16
+             : name == "32" ? 32 : name == "64" ? 64 : 0;
+    bool isValid = (field.kind == 'u' || field.kind == 's') ? bits > 0
+                 : field.kind == 'f' ? bits == 32 || bits == 64
+                 : false;
+    MAL_CHECK(isValid, "Unknown field type %s",
+              String(format->view()).c_str());
+    field.size = bits / 8;
+    return field;
+}
+
+static uint8_t* fieldAt(malBytes* bytes, int64_t offset,
+                        const BinaryField& field)
+{
+    MAL_CHECK(offset >= 0 && offset + field.size <= bytes->size(),
+              "Index out of range");
+    return bytes->data().data() + offset;
+}
+
+static malValuePtr getField(malBytes* bytes, int64_t offset,
+                            const BinaryField& field)
+{
+    const uint8_t* at = fieldAt(bytes, offset, field);
+    uint64_t raw = 0;
+    for (size_t i = 0; i < field.size; i++) {
+        raw = raw << 8 | at[field.isBigEndian ? i : field.size - 1 - i];
+    }
+    if (field.kind == 'f') {
+        if (field.size == 4) {
+            uint32_t bits = raw;
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return mal::mdouble(value);
+        }
+        double value;
+        memcpy(&value, &raw, sizeof(value));
+        return mal::mdouble(value);
+    }
+    int shift = 64 - 8 * field.size;
+    if (field.kind == 's' && shift > 0) {
+        return mal::integer((int64_t)(raw << shift) >> shift);
+    }
+    // A :u64 past INT64_MAX wraps around, there is nothing bigger.
+    return mal::integer((int64_t)raw);
+}
+
+static void putField(malBytes* bytes, int64_t offset,
+                     const BinaryField& field, const malValuePtr& value)
+{
+    uint8_t* at = fieldAt(bytes, offset, field);
+    uint64_t raw;
+    if (field.kind == 'f') {
+        double number = value->type() == MALTYPE::REAL
+            ? STATIC_CAST(malDouble, value)->value()
+            : VALUE_CAST(malInteger, value)->value();
+        if (field.size == 4) {
+            float single = number;
+            uint32_t bits;
+            memcpy(&bits, &single, sizeof(bits));
+            raw = bits;
+        }
+        else {
+            memcpy(&raw, &number, sizeof(raw));
+        }
+    }
+    else {
+        raw = VALUE_CAST(malInteger, value)->value();
+    }
+    for (size_t i = 0; i < field.size; i++) {
+        at[field.isBigEndian ? field.size - 1 - i : i] = raw & 0xff;
+        raw >>= 8;
+    }
+}
+
+static StringVec commandOf(const malValuePtr& command)
+{
+    if (const malString* line = DYNAMIC_CAST(malString, command)) {
+        return malProcess::commandArgv(line->value());
+    }
+    const malSequence* words = VALUE_CAST(malSequence, command);
+    StringVec argv;
+    for (const auto& word : *words) {
+        argv.push_back(VALUE_CAST(malString, word)->value());
+    }
+    MAL_CHECK(!argv.empty(), "Nothing to run");
+    return argv;
+}
+
+static malProcess::Stream streamOption(const malHash* options,
+                                       const char* name,
+                                       malProcess::Stream otherwise)
+{
+    if (!options) {
+        return otherwise;
+    }
+    auto found = options->map().find(name);
+    if (found == options->map().end()) {
+        return otherwise;
+    }
+    const malKeyword* stream = VALUE_CAST(malKeyword, found->second);
+    if (stream->view() == ":pipe") {
+        return malProcess::PIPE;
+    }
+    if (stream->view() == ":inherit") {
+        return malProcess::INHERIT;
+    }
+    MAL_CHECK(stream->view() == ":null", "Bad stream %s for %s",
+              String(stream->view()).c_str(), name);
+    return malProcess::DISCARD;
+}
+
+static malValuePtr unixSocket(const String& path, bool isListening)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    MAL_CHECK(path.size() < sizeof(address.sun_path), "Path too long: %s",
+              path.c_str());
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    MAL_CHECK(fd >= 0, "Cannot create socket: %s", strerror(errno));
+    int result = isListening
+        ? bind(fd, (sockaddr*)&address, sizeof(address))
+        : connect(fd, (sockaddr*)&address, sizeof(address));
+    if (result == 0 && isListening) {
+        result = listen(fd, SOMAXCONN);
+    }
+    if (result != 0) {
+        int error = errno;
+        close(fd);
+        MAL_FAIL("Cannot %s %s: %s", isListening ? "listen on" : "connect to",
+                 path.c_str(), strerror(error));
+    }
+    return socketFile(fd, path);
+}
+
+static malValuePtr socketFile(int fd, const String& path)
+{
+    ::FILE* file = fdopen(fd, "r+");
+    if (!file) {
+        close(fd);
+        MAL_FAIL("Cannot open socket %s", path.c_str());
+    }
+    return malValuePtr(new malFile(path.c_str(), '+', file));
+}
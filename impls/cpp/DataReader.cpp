@@ -0,0 +1,312 @@
+#include "MAL.h"
+#include "Types.h"
+
+#include <charconv>
+#include <memory>
+#include <string.h>
+
+// Reads the literals pr-str writes: numbers, strings, keywords, lists,
+// vectors, maps, nil, true and false. Unlike the code reader there are no
+// regexes, symbols or reader macros, and each character is looked at once,
+// in place.
+
+namespace {
+
+enum CharClass : uint8_t { OTHER, SPACE, DELIMITER };
+
+// Whitespace, which includes commas, and the characters ending a token.
+struct CharClasses {
+    CharClasses() {
+        memset(table, OTHER, sizeof(table));
+        for (unsigned char c : String(" \t\n\r\f\v,")) {
+            table[c] = SPACE;
+        }
+        for (unsigned char c : String("()[]{}\";")) {
+            table[c] = DELIMITER;
+        }
+    }
+    uint8_t table[256];
+};
+
+const CharClasses s_classes;
+
+class DataReader {
+public:
+    DataReader(std::string_view input)
+        : m_begin(input.data()), m_pos(m_begin), m_end(m_begin + input.size())
+    { }
+
+    // false once only whitespace and comments are left.
+    bool skipSpace();
+    malValuePtr readForm();
+
+private:
+    void readItems(char close, malValueVec* items);
+    malValuePtr readHash();
+    // Also sets key to what a hash files the string under, if asked to.
+    malValuePtr readString(String* key);
+    malValuePtr readAtom();
+    std::string_view readToken();
+
+    [[noreturn]] void fail(const char* what, std::string_view token);
+
+    const char* m_begin;
+    const char* m_pos;
+    const char* m_end;
+};
+
+bool DataReader::skipSpace()
+{
+    while (m_pos < m_end) {
+        unsigned char c = *m_pos;
+        if (s_classes.table[c] == SPACE) {
+            m_pos++;
+        }
+        else if (c == ';') {
+            const char* eol = (const char*)memchr(m_pos, '\n', m_end - m_pos);
+            m_pos = eol ? eol + 1 : m_end;
+        }
+        else {
+            return true;
+        }
+    }
+    return false;
+}
+
+malValuePtr DataReader::readForm()
+{
+    if (!skipSpace()) {
+        fail("expected form, got EOF", "");
+    }
+    switch (*m_pos) {
+        case '(': {
+            m_pos++;
+            std::unique_ptr<malValueVec> items(new malValueVec);
+            readItems(')', items.get());
+            return mal::list(items.release());
+        }
+        case '[': {
+            m_pos++;
+            std::unique_ptr<malValueVec> items(new malValueVec);
+            readItems(']', items.get());
+            return mal::vector(items.release());
+        }
+        case '{':
+            m_pos++;
+            return readHash();
+        case '"':
+            return readString(NULL);
+        case ')': case ']': case '}':
+            fail("unexpected '%s'", std::string_view(m_pos, 1));
+    }
+    return readAtom();
+}
+
+void DataReader::readItems(char close, malValueVec* items)
+{
+    for (;;) {
+        if (!skipSpace()) {
+            fail("expected '%s', got EOF", std::string_view(&close, 1));
+        }
+        if (*m_pos == close) {
+            m_pos++;
+            return;
+        }
+        items->push_back(readForm());
+    }
+}
+
+malValuePtr DataReader::readHash()
+{
+    // Keys go into the map as the printed form makeHashKey would give
+    // them, which for most is the text they were read from.
+    malHash::Map map;
+    for (;;) {
+        if (!skipSpace()) {
+            fail("expected '%s', got EOF", "}");
+        }
+        if (*m_pos == '}') {
+            m_pos++;
+            return mal::hash(std::move(map));
+        }
+        String key;
+        if (*m_pos == '"') {
+            readString(&key);
+        }
+        else if (*m_pos == ':') {
+            // A keyword is its own key, it needn't be made.
+            key = readToken();
+        }
+        else {
+            const char* start = m_pos;
+            readForm();
+            fail("'%s' is not a string or keyword",
+                 std::string_view(start, m_pos - start));
+        }
+        malValuePtr value = readForm();
+        map.insert_or_assign(std::move(key), value);
+    }
+}
+
+malValuePtr DataReader::readString(String* key)
+{
+    const char* start = ++m_pos;
+    const char* quote = (const char*)memchr(start, '"', m_end - start);
+    if (!quote) {
+        fail("expected '%s', got EOF", "\"");
+    }
+    // Without a backslash, the string is exactly what lies between the
+    // quotes. memchr finds both quickly enough to look for each.
+    if (!memchr(start, '\\', quote - start)) {
+        m_pos = quote + 1;
+        std::string_view text(start, quote - start);
+        if (key) {
+            bool isPrinted = !memchr(start, '\n', quote - start);
+            *key = isPrinted ? String(start - 1, text.size() + 2)
+                             : escape(String(text));
+        }
+        return mal::string(text);
+    }
+
+    String text;
+    text.reserve(quote - start);
+    // Whether the escapes used are those escape() would use.
+    bool isPrinted = true;
+    const char* p = start;
+    for (;;) {
+        const char* next = p;
+        while (next < m_end && *next != '"' && *next != '\\') {
+            next++;
+        }
+        if (next == m_end) {
+            fail("expected '%s', got EOF", "\"");
+        }
+        isPrinted = isPrinted && !memchr(p, '\n', next - p);
+        text.append(p, next - p);
+        if (*next == '"') {
+            p = next + 1;
+            break;
+        }
+        if (next + 1 == m_end) {
+            fail("expected '%s', got EOF", "\"");
+        }
+        char c = next[1];
+        isPrinted = isPrinted && (c == '\\' || c == '"' || c == 'n');
+        text += c == 'n' ? '\n' : c;
+        p = next + 2;
+    }
+    if (key) {
+        *key = isPrinted ? String(start - 1, p - start + 1) : escape(text);
+    }
+    m_pos = p;
+    return mal::string(text);
+}
+
+std::string_view DataReader::readToken()
+{
+    const char* start = m_pos;
+    while (m_pos < m_end
+           && s_classes.table[(unsigned char)*m_pos] == OTHER) {
+        m_pos++;
+    }
+    return std::string_view(start, m_pos - start);
+}
+
+malValuePtr DataReader::readAtom()
+{
+    std::string_view token = readToken();
+    if (token[0] == ':') {
+        return mal::keyword(token);
+    }
+    if (token == "nil") {
+        return mal::nilValue();
+    }
+    if (token == "true") {
+        return mal::trueValue();
+    }
+    if (token == "false") {
+        return mal::falseValue();
+    }
+
+    // [+-]digits, then optionally a fraction and an exponent.
+    const char* start = token.data();
+    const char* end = m_pos;
+    const char* p = start;
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    const char* digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    bool isNumber = p > digits;
+    bool isInteger = isNumber && p == end;
+    if (isNumber && p < end && *p == '.') {
+        const char* fraction = ++p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+        isNumber = p > fraction;
+    }
+    if (isNumber && p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+        const char* exponent = p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+        isNumber = p > exponent;
+    }
+    if (!isNumber || p != end) {
+        fail("unexpected '%s'", token);
+    }
+    // from_chars takes no leading +.
+    const char* from = *start == '+' ? start + 1 : start;
+    if (isInteger) {
+        int64_t value;
+        auto result = std::from_chars(from, end, value);
+        if (result.ec == std::errc()) {
+            return mal::integer(value);
+        }
+        fail("integer out of range: %s", token);
+    }
+    double value;
+    if (std::from_chars(from, end, value).ec != std::errc()) {
+        fail("number out of range: %s", token);
+    }
+    return mal::mdouble(value);
+}
+
+void DataReader::fail(const char* what, std::string_view token)
+{
+    // Where, as a line number, as files of data can be big.
+    int line = 1;
+    for (const char* p = m_begin; p < m_pos; p++) {
+        line += *p == '\n';
+    }
+    MAL_FAIL("%s at line %d", stringPrintf(what, String(token).c_str()).c_str(),
+             line);
+}
+
+}
+
+malValuePtr readData(std::string_view input)
+{
+    DataReader reader(input);
+    if (!reader.skipSpace()) {
+        throw malEmptyInputException();
+    }
+    return reader.readForm();
+}
+
+malValueVec* readDataForms(std::string_view input)
+{
+    DataReader reader(input);
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    while (reader.skipSpace()) {
+        items->push_back(reader.readForm());
+    }
+    return items.release();
+}
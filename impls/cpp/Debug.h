@@ -7,6 +7,7 @@
 #define DEBUG_TRACE                    1
 //#define DEBUG_OBJECT_LIFETIMES         1
 //#define DEBUG_ENV_LIFETIMES            1
+//#define DEBUG_REFCOUNT_STATS           1
 
 #define DEBUG_TRACE_FILE    stderr
 
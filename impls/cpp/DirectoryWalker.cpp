@@ -0,0 +1,259 @@
+#include "DirectoryWalker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static String joinPath(const String& directory, const char* name)
+{
+    if (directory.empty()) {
+        return name;
+    }
+    String path = directory;
+    if (path.back() != '/') {
+        path += '/';
+    }
+    return path + name;
+}
+
+malDirectoryWalker::malDirectoryWalker(const String& root,
+                                       const String& pattern,
+                                       int kinds, bool isRecursive)
+: m_root(root)
+, m_pattern(pattern)
+, m_wildcard(pattern)
+, m_kinds(kinds)
+, m_isRecursive(isRecursive)
+, m_pending(1)
+, m_isStopping(false)
+{
+    while (m_root.size() > 1 && m_root.back() == '/') {
+        m_root.pop_back();
+    }
+    // Listing is mostly waiting on the file system, so a couple of threads
+    // pay off even on a single core.
+    size_t threads = 1;
+    if (isRecursive) {
+        threads = std::max(2u, std::min(std::thread::hardware_concurrency(),
+                                        16u));
+    }
+    for (size_t i = 0; i < threads; i++) {
+        m_workers.emplace_back(new Worker);
+    }
+    m_workers[0]->directories.push_back("");
+    for (size_t i = 0; i < threads; i++) {
+        m_threads.emplace_back(&malDirectoryWalker::run, this, i);
+    }
+}
+
+malDirectoryWalker::~malDirectoryWalker()
+{
+    m_isStopping = true;
+    {
+        std::lock_guard<std::mutex> lock(m_foundLock);
+    }
+    m_foundChanged.notify_all();
+    m_workAdded.notify_all();
+    for (auto& thread : m_threads) {
+        thread.join();
+    }
+}
+
+bool malDirectoryWalker::next(String& path)
+{
+    std::unique_lock<std::mutex> lock(m_foundLock);
+    m_foundChanged.wait(lock, [this] {
+        return !m_found.empty() || m_pending == 0;
+    });
+    if (m_found.empty()) {
+        return false;
+    }
+    path = std::move(m_found.front());
+    m_found.pop_front();
+    bool wasFull = m_found.size() + 1 >= MAX_WAITING;
+    lock.unlock();
+    if (wasFull) {
+        m_foundChanged.notify_all();
+    }
+    return true;
+}
+
+void malDirectoryWalker::run(size_t index)
+{
+    String directory;
+    while (!m_isStopping) {
+        if (take(index, directory)) {
+            list(index, directory);
+            if (--m_pending == 0) {
+                {
+                    std::lock_guard<std::mutex> lock(m_foundLock);
+                }
+                m_foundChanged.notify_all();
+                m_workAdded.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_idleLock);
+        if (m_pending == 0) {
+            break;
+        }
+        // The timeout covers work added between take() and the wait.
+        m_workAdded.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+bool malDirectoryWalker::take(size_t index, String& directory)
+{
+    // Newest first from our own queue, which keeps to one part of the
+    // tree, oldest first from the others', which tend to be the biggest.
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        Worker& worker = *m_workers[(index + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(worker.lock);
+        if (worker.directories.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            directory = std::move(worker.directories.back());
+            worker.directories.pop_back();
+        }
+        else {
+            directory = std::move(worker.directories.front());
+            worker.directories.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void malDirectoryWalker::list(size_t index, const String& directory)
+{
+    String fullPath = joinPath(m_root, directory.c_str());
+    DIR* dir = opendir(fullPath.c_str());
+    if (!dir) {
+        return;
+    }
+    std::vector<String> paths;
+    std::vector<String> subdirectories;
+    while (const dirent* entry = readdir(dir)) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (m_isStopping) {
+            break;
+        }
+        // d_type saves a stat for each entry, on file systems that have it.
+        bool isDirectory = entry->d_type == DT_DIR;
+        bool isLink = entry->d_type == DT_LNK;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(joinPath(fullPath, name).c_str(), &st) == 0) {
+                isDirectory = S_ISDIR(st.st_mode);
+                isLink = S_ISLNK(st.st_mode);
+            }
+        }
+        bool listsAsDirectory = isDirectory;
+        if (isLink) {
+            struct stat st;
+            listsAsDirectory = stat(joinPath(fullPath, name).c_str(), &st) == 0
+                            && S_ISDIR(st.st_mode);
+        }
+
+        String path = joinPath(directory, name);
+        bool isWanted = m_kinds == ALL
+                     || (m_kinds == DIRECTORIES) == listsAsDirectory;
+        if (isWanted
+            && (m_pattern.empty() || m_wildcard.matches(name))) {
+            paths.push_back(path);
+            // Hand over what a huge directory has so far.
+            if (paths.size() >= 4096) {
+                found(paths);
+            }
+        }
+        if (m_isRecursive && isDirectory) {
+            subdirectories.push_back(std::move(path));
+        }
+    }
+    closedir(dir);
+
+    if (!subdirectories.empty()) {
+        m_pending += subdirectories.size();
+        Worker& worker = *m_workers[index];
+        {
+            std::lock_guard<std::mutex> lock(worker.lock);
+            for (auto& subdirectory : subdirectories) {
+                worker.directories.push_back(std::move(subdirectory));
+            }
+        }
+        m_workAdded.notify_all();
+    }
+    found(paths);
+}
+
+void malDirectoryWalker::found(std::vector<String>& paths)
+{
+    if (paths.empty()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_foundLock);
+    m_foundChanged.wait(lock, [this] {
+        return m_found.size() < MAX_WAITING || m_isStopping;
+    });
+    for (auto& path : paths) {
+        m_found.push_back(std::move(path));
+    }
+    paths.clear();
+    lock.unlock();
+    m_foundChanged.notify_all();
+}
+
+bool compareNatural(std::string_view a, std::string_view b)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+            // Compare the numbers by their digits, past any leading zeros:
+            // the longer one is bigger, or else the first that differs.
+            while (i < a.size() && a[i] == '0') {
+                i++;
+            }
+            while (j < b.size() && b[j] == '0') {
+                j++;
+            }
+            size_t aEnd = i;
+            while (aEnd < a.size() && isdigit((unsigned char)a[aEnd])) {
+                aEnd++;
+            }
+            size_t bEnd = j;
+            while (bEnd < b.size() && isdigit((unsigned char)b[bEnd])) {
+                bEnd++;
+            }
+            if (aEnd - i != bEnd - j) {
+                return aEnd - i < bEnd - j;
+            }
+            int order = a.substr(i, aEnd - i).compare(b.substr(j, bEnd - j));
+            if (order != 0) {
+                return order < 0;
+            }
+            i = aEnd;
+            j = bEnd;
+            continue;
+        }
+        int aChar = toupper((unsigned char)a[i]);
+        int bChar = toupper((unsigned char)b[j]);
+        if (aChar != bChar) {
+            return aChar < bChar;
+        }
+        i++;
+        j++;
+    }
+    if (a.size() - i != b.size() - j) {
+        return a.size() - i < b.size() - j;
+    }
+    // Equal but for case or leading zeros, which still need an order.
+    return a < b;
+}
@@ -0,0 +1,73 @@
+#ifndef INCLUDE_DIRECTORYWALKER_H
+#define INCLUDE_DIRECTORYWALKER_H
+
+#include "MAL.h"
+#include "Wildcard.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Lists a directory, or the whole tree under it, on threads of its own.
+// Each thread works through a queue of directories of its own and takes
+// from the others' when it runs out, so one big subdirectory doesn't
+// leave the rest idle. Paths can be taken as soon as they are found, in
+// no particular order. Only strings cross threads, never mal values.
+class malDirectoryWalker {
+public:
+    enum Kinds { DIRECTORIES = -1, ALL = 0, FILES = 1 };
+
+    // Paths relative to root of the entries of the given kinds whose names
+    // match pattern, as wcmatch matches them, or of all of them when it
+    // is empty. Links are listed as what they point to, but not followed.
+    malDirectoryWalker(const String& root, const String& pattern,
+                       int kinds, bool isRecursive);
+    ~malDirectoryWalker();
+
+    // Waits for the next path. false once the walk is over.
+    bool next(String& path);
+
+private:
+    malDirectoryWalker(const malDirectoryWalker&); // no copy ctor
+
+    struct Worker {
+        std::mutex lock;
+        std::deque<String> directories;
+    };
+
+    void run(size_t index);
+    bool take(size_t index, String& directory);
+    void list(size_t index, const String& directory);
+    void found(std::vector<String>& paths);
+
+    // How many found paths may wait for next() before the walk waits too.
+    enum { MAX_WAITING = 64 * 1024 };
+
+    String m_root;
+    String m_pattern;
+    malWildcard m_wildcard;     // shared by the threads, matching is const
+    int m_kinds;
+    bool m_isRecursive;
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_pending;      // directories queued or being listed
+    std::atomic<bool> m_isStopping;
+    std::mutex m_idleLock;
+    std::condition_variable m_workAdded;
+
+    std::mutex m_foundLock;
+    std::condition_variable m_foundChanged;
+    std::deque<String> m_found;
+};
+
+// Natural order: runs of digits compare as numbers, everything else
+// ignoring case, so "file9" comes before "File10".
+bool compareNatural(std::string_view a, std::string_view b);
+
+#endif // INCLUDE_DIRECTORYWALKER_H
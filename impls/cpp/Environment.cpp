@@ -3,42 +3,104 @@
 
 #include <iostream>
 #include <algorithm>
+#include <iterator>
+
+malParams::malParams(const StringVec& bindings)
+: m_arity(0)
+, m_isVariadic(false)
+{
+    int n = bindings.size();
+    int i = 0;
+
+    for ( ; i < n && bindings[i] != "&" && bindings[i] != "/"; i++) {
+        m_names.push_back(bindings[i]);
+    }
+    m_arity = i;
+
+    if (i < n && bindings[i] == "&") {
+        MAL_CHECK(i + 1 < n && bindings[i+1] != "/",
+                  "There must be one parameter after the &");
+        m_names.push_back(bindings[i+1]);
+        m_isVariadic = true;
+        i += 2;
+    }
+
+    if (i < n) {
+        MAL_CHECK(bindings[i] == "/", "Unexpected '%s' in parameter list",
+                  bindings[i].c_str());
+        m_names.insert(m_names.end(), bindings.begin() + i + 1, bindings.end());
+    }
+}
+
+int malParams::indexOf(const String& symbol) const
+{
+    for (int i = 0, n = m_names.size(); i < n; i++) {
+        if (m_names[i] == symbol) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const malCaptures* malParams::captures(malValuePtr body) const
+{
+    return m_capturesBody == body ? &m_captures : NULL;
+}
+
+const malCaptures& malParams::setCaptures(malValuePtr body,
+                                          const malCaptures& captures) const
+{
+    m_capturesBody = body;
+    m_captures = captures;
+    return m_captures;
+}
+
+static bool contains(const StringVec& names, const String& name)
+{
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+static bool isCell(const malValuePtr& value)
+{
+    return value && value->hasFlag(RefCounted::IS_CELL);
+}
 
 malEnv::malEnv(malEnvPtr outer)
 : m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (outer) {
+        setFlag(GC_CONTAINER);
+    }
 }
 
 malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
 : m_outer(outer)
+, m_params(new malParams(bindings))
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
-    setLamdaMode(true);
-    int n = bindings.size();
-    for (auto &it : bindings) {
-        if (it != "&" ||
-            it != "/")
-            {
-                m_bindings.push_back(it);
-            }
-    }
+    setFlag(GC_CONTAINER);
+    bindArgs(malValueVec(argsBegin, argsEnd));
+}
 
-    auto it = argsBegin;
-    for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&" ||
-            bindings[i] == "/"
-        ) {
-            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
-            set(bindings[n-1], mal::list(it, argsEnd));
-            return;
-        }
-        MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
-        ++it;
-    }
-    MAL_CHECK(it == argsEnd, "Too many parameters");
+malEnv::malEnv(malEnvPtr outer, malParamsPtr params,
+               malValueIter argsBegin, malValueIter argsEnd)
+: m_outer(outer)
+, m_params(params)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setFlag(GC_CONTAINER);
+    bindArgs(malValueVec(argsBegin, argsEnd));
+}
+
+malEnv::malEnv(malEnvPtr outer, malParamsPtr params, malValueVec&& args)
+: m_outer(outer)
+, m_params(params)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    setFlag(GC_CONTAINER);
+    bindArgs(std::move(args));
 }
 
 malEnv::~malEnv()
@@ -46,10 +108,48 @@ malEnv::~malEnv()
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
+void malEnv::bindArgs(malValueVec&& args)
+{
+    setLamdaMode(true);
+
+    int arity = m_params->arity();
+    int argCount = args.size();
+    MAL_CHECK(argCount >= arity, "Not enough parameters");
+    MAL_CHECK(argCount == arity || m_params->isVariadic(),
+              "Too many parameters");
+
+    // Parameters live in slots laid out by the shared descriptor, which
+    // the arguments already are, apart from the & rest. Locals (AutoLISP
+    // args / locals) start out as nil, so setq on them never leaves the
+    // function.
+    if (m_params->isVariadic()) {
+        auto restBegin = args.begin() + arity;
+        malValuePtr rest = mal::list(new malValueVec(
+            std::make_move_iterator(restBegin),
+            std::make_move_iterator(args.end())));
+        args.erase(restBegin, args.end());
+        args.push_back(std::move(rest));
+    }
+    m_slots = std::move(args);
+    m_slots.resize(m_params->slotCount(), mal::nilValue());
+}
+
+malValuePtr* malEnv::lookup(const String& symbol)
+{
+    if (m_params) {
+        int index = m_params->indexOf(symbol);
+        if (index >= 0) {
+            return &m_slots[index];
+        }
+    }
+    auto it = m_map.find(symbol);
+    return it != m_map.end() ? &it->second : NULL;
+}
+
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->lookup(symbol)) {
             return env;
         }
     }
@@ -58,36 +158,162 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (malValuePtr* slot = env->lookup(symbol)) {
+            return isCell(*slot) ? STATIC_CAST(malCell, *slot)->value()
+                                 : *slot;
         }
     }
     MAL_FAIL("'%s' not found", symbol.c_str());
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malValuePtr malEnv::set(const String& symbol, const malValuePtr& value)
 {
     if (isLamda()) {
-        for (auto &it : m_bindings) {
-            if (symbol == it) {
-                m_map[symbol] = value;
-                return value;
-            }
+        // Lambda frames only hold their parameters, locals and loop
+        // variables, all of which are bound on creation. Anything else
+        // belongs further out.
+        malValuePtr* slot = lookup(symbol);
+        if (!slot) {
+            return m_outer->set(symbol, value);
         }
-        m_outer.ptr()->set(symbol, value);
+        assign(*slot, value);
     }
     else {
-        m_map[symbol] = value;
+        assign(m_map[symbol], value);
     }
     return value;
 }
 
+void malEnv::assign(malValuePtr& slot, const malValuePtr& value)
+{
+    if (isCell(slot)) {
+        STATIC_CAST(malCell, slot)->setValue(value);
+    }
+    else {
+        slot = value;
+    }
+}
+
+malValuePtr malEnv::cellFor(const String& symbol)
+{
+    malValuePtr* slot = lookup(symbol);
+    if (!isCell(*slot)) {
+        *slot = mal::cell(*slot);
+    }
+    return *slot;
+}
+
+malEnvPtr malEnv::capture(const malCaptures& captures)
+{
+    if (!m_outer || captures.isDynamic) {
+        return this;
+    }
+
+    // A non-lambda frame between here and the root (let*, catch*) is where
+    // a set that isn't bound on the way ends up, so it can gain bindings
+    // after the closure has been created, and shadow a global the body
+    // reads as well as one it sets.
+    malEnv* root = this;
+    bool hasScope = false;
+    for ( ; root->m_outer; root = root->m_outer.ptr()) {
+        hasScope |= !root->isLamda();
+    }
+
+    auto owner = [this, root](const String& symbol, malValuePtr*& slot,
+                              bool& crossedScope) {
+        crossedScope = false;
+        for (malEnv* env = this; env != root; env = env->m_outer.ptr()) {
+            if ((slot = env->lookup(symbol))) {
+                return env;
+            }
+            crossedScope |= !env->isLamda();
+        }
+        slot = root->lookup(symbol);
+        return (malEnv*)NULL;
+    };
+
+    std::vector<const String*> names;
+    malValueVec cells;
+    names.reserve(captures.free.size());
+    cells.reserve(captures.free.size());
+    for (const String& symbol : captures.free) {
+        malValuePtr* slot;
+        bool crossedScope;
+        malEnv* env = owner(symbol, slot, crossedScope);
+        if (!slot) {
+            return this; // may yet be defined somewhere along the chain
+        }
+        if (env ? crossedScope : hasScope) {
+            return this; // the nearer frame may still get its own
+        }
+        if (contains(captures.heads, symbol)) {
+            malValuePtr value = isCell(*slot)
+                ? STATIC_CAST(malCell, *slot)->value() : *slot;
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+            if (lambda && lambda->isMacro()) {
+                return this; // its expansion may use anything in scope
+            }
+        }
+        if (env) {
+            names.push_back(&symbol);
+            cells.push_back(env->cellFor(symbol));
+        }
+    }
+
+    for (const String& symbol : captures.optional) {
+        malValuePtr* slot;
+        bool crossedScope;
+        if (malEnv* env = owner(symbol, slot, crossedScope)) {
+            names.push_back(&symbol);
+            cells.push_back(env->cellFor(symbol));
+        }
+    }
+
+    if (cells.empty()) {
+        return root;
+    }
+    if (names != captures.layoutNames) {
+        StringVec layout;
+        for (const String* name : names) {
+            layout.push_back(*name);
+        }
+        captures.layoutNames = names;
+        captures.layout = new malParams(layout);
+    }
+    return new malEnv(root, captures.layout, cells.begin(), cells.end());
+}
+
+void malEnv::traverse(RefVisitor& visitor) const
+{
+    visitor(m_outer);
+    for (auto& it : m_map) {
+        visitor(it.second);
+    }
+    for (auto& it : m_slots) {
+        visitor(it);
+    }
+}
+
+void malEnv::gcClear()
+{
+    m_map.clear();
+    m_slots.clear();
+    m_params = NULL;
+    m_outer = NULL;
+}
+
+malValuePtr& malEnv::bind(const String& symbol)
+{
+    // Map nodes never move, so the caller can keep the returned slot and
+    // assign to it directly for as long as this env is alive.
+    return m_map[symbol];
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
-    for (malEnvPtr env = this; ; env = env->m_outer) {
+    for (malEnv* env = this; ; env = env->m_outer.ptr()) {
         if (!env->m_outer) {
             return env;
         }
@@ -2,16 +2,65 @@
 #define INCLUDE_ENVIRONMENT_H
 
 #include "MAL.h"
+#include "Collector.h"
 
 #include <map>
 
-class malEnv : public RefCounted {
+// What a closure body needs from the env it is created in. Worked out
+// once per fn* node by the evaluator, see malEnv::capture().
+struct malCaptures {
+    StringVec free;      // symbols the body may read or set
+    StringVec heads;     // call heads, which must not turn out to be macros
+    StringVec optional;  // captured if bound here, ignored otherwise
+    bool isDynamic = false; // body looks names up at runtime (set, bound?)
+
+    // Slot layout of the last frame of cells built from these, reused
+    // while closures keep capturing the same variables.
+    mutable std::vector<const String*> layoutNames;
+    mutable malParamsPtr layout;
+};
+
+class malParams : public RefCounted {
+public:
+    // Compiles a binding list such as (a b & rest) or (a b / tmp).
+    malParams(const StringVec& bindings);
+
+    int arity() const { return m_arity; }
+    bool isVariadic() const { return m_isVariadic; }
+    int slotCount() const { return m_names.size(); }
+    int indexOf(const String& symbol) const;
+
+    // Captures of the body last compiled against these parameters, or
+    // NULL if body is a different one.
+    const malCaptures* captures(malValuePtr body) const;
+    const malCaptures& setCaptures(malValuePtr body,
+                                   const malCaptures& captures) const;
+
+private:
+    // Positional parameters, then the & parameter, then the locals.
+    StringVec m_names;
+    int m_arity;
+    bool m_isVariadic;
+
+    mutable malValuePtr m_capturesBody;
+    mutable malCaptures m_captures;
+};
+
+class malEnv : public RefCounted, public malGcTracked {
 public:
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
            const StringVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
+    malEnv(malEnvPtr outer,
+           malParamsPtr params,
+           malValueIter argsBegin,
+           malValueIter argsEnd);
+    // Takes over the evaluated arguments as its slots.
+    malEnv(malEnvPtr outer,
+           malParamsPtr params,
+           malValueVec&& args);
 
     ~malEnv();
 
@@ -20,14 +69,35 @@ public:
 
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
+    malValuePtr set(const String& symbol, const malValuePtr& value);
+    malValuePtr& bind(const String& symbol);
     malEnvPtr   getRoot();
 
+    // The env a closure created here should keep: a frame of cells for
+    // the local variables its body uses, over the root env. Falls back to
+    // this env when that can't be done without changing what the body
+    // would see.
+    malEnvPtr   capture(const malCaptures& captures);
+
+    // Stores into a slot returned by bind(), writing through a cell.
+    static void assign(malValuePtr& slot, const malValuePtr& value);
+
+    // The root env isn't flagged as a container, so the collector never
+    // scans it.
+    virtual void traverse(RefVisitor& visitor) const;
+    virtual void gcClear();
+    virtual const RefCounted* gcObject() const { return this; }
+
 private:
+    void bindArgs(malValueVec&& args);
+    malValuePtr* lookup(const String& symbol);
+    malValuePtr  cellFor(const String& symbol);
+
     typedef std::map<String, malValuePtr> Map;
     Map m_map;
     malEnvPtr m_outer;
-    StringVec m_bindings;
+    malParamsPtr m_params;
+    malValueVec m_slots;
     bool m_isLamda = false;
 };
 
@@ -0,0 +1,307 @@
+#include "EventLoop.h"
+#include "Process.h"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <map>
+#include <string.h>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Watch {
+    malEventLoop::Event event;
+    int fd;
+    ::FILE* file;           // what fd belonged to when it was watched
+    bool isPolled;          // through epoll, else always ready
+    bool isOneShot;
+    malValuePtr source;     // kept alive, and open, while watched
+    malValuePtr callback;
+};
+
+struct Loop {
+    int epollFd = -1;
+    int nextId = 1;
+    bool isStopped = false;
+    std::map<int, Watch> watches;                       // oldest first
+    std::unordered_map<int, std::vector<int>> byFd;     // polled only
+    std::unordered_map<int, uint32_t> registered;       // fd -> events
+};
+
+// Leaked, so the callbacks and files its watches hold aren't released
+// during static destruction, when what they refer to may be gone.
+Loop& loop()
+{
+    static Loop* instance = new Loop;
+    if (instance->epollFd < 0) {
+        instance->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        MAL_CHECK(instance->epollFd >= 0, "Cannot create event loop: %s",
+                  strerror(errno));
+    }
+    return *instance;
+}
+
+uint32_t eventsOf(malEventLoop::Event event)
+{
+    return event == malEventLoop::WRITABLE ? EPOLLOUT : EPOLLIN;
+}
+
+// Tells epoll what is wanted of fd now.
+void update(Loop& l, int fd)
+{
+    uint32_t events = 0;
+    auto ids = l.byFd.find(fd);
+    if (ids != l.byFd.end()) {
+        for (int id : ids->second) {
+            events |= eventsOf(l.watches.at(id).event);
+        }
+    }
+    auto found = l.registered.find(fd);
+    if (events == 0) {
+        if (found != l.registered.end()) {
+            epoll_ctl(l.epollFd, EPOLL_CTL_DEL, fd, NULL);
+            l.registered.erase(found);
+        }
+        return;
+    }
+    if (found != l.registered.end() && found->second == events) {
+        return;
+    }
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    // A file closed since it was registered has left epoll by itself.
+    if (found == l.registered.end()
+        || (epoll_ctl(l.epollFd, EPOLL_CTL_MOD, fd, &ev) != 0
+            && errno == ENOENT)) {
+        MAL_CHECK(epoll_ctl(l.epollFd, EPOLL_CTL_ADD, fd, &ev) == 0,
+                  "Cannot watch %d: %s", fd, strerror(errno));
+    }
+    l.registered[fd] = events;
+}
+
+void remove(Loop& l, std::map<int, Watch>::iterator it)
+{
+    Watch& watch = it->second;
+    int fd = watch.fd;
+    bool isPolled = watch.isPolled;
+    if (watch.event == malEventLoop::TIMEOUT) {
+        close(fd);
+    }
+    int id = it->first;
+    l.watches.erase(it);
+    if (isPolled) {
+        auto& ids = l.byFd[fd];
+        ids.erase(std::find(ids.begin(), ids.end(), id));
+        if (ids.empty()) {
+            l.byFd.erase(fd);
+        }
+        update(l, fd);
+    }
+}
+
+bool isStale(const Watch& watch)
+{
+    const malFile* file = DYNAMIC_CAST(malFile, watch.source);
+    return file && file->value() != watch.file;
+}
+
+// Drops the watches of files closed since, before their fds are reused.
+// Those fds left epoll with their files, so epoll isn't told.
+void sweep(Loop& l)
+{
+    for (auto it = l.watches.begin(); it != l.watches.end(); ) {
+        if (isStale(it->second)) {
+            l.byFd.erase(it->second.fd);
+            l.registered.erase(it->second.fd);
+            it = l.watches.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+int add(Loop& l, Watch watch)
+{
+    sweep(l);
+    int id = l.nextId++;
+    int fd = watch.fd;
+    bool isPolled = watch.isPolled;
+    l.watches.emplace(id, std::move(watch));
+    if (isPolled) {
+        l.byFd[fd].push_back(id);
+        try {
+            update(l, fd);
+        }
+        catch (...) {
+            remove(l, l.watches.find(id));
+            throw;
+        }
+    }
+    return id;
+}
+
+bool isReady(const Watch& watch)
+{
+    if (!watch.isPolled) {
+        return true;
+    }
+    const malFile* file = DYNAMIC_CAST(malFile, watch.source);
+    return file && watch.event == malEventLoop::READABLE
+        && file->hasBufferedInput();
+}
+
+}
+
+int malEventLoop::watchFile(malFile* file, Event event, malValuePtr callback)
+{
+    MAL_CHECK(file->isOpen(), "i/o file is closed");
+    int fd = fileno(file->value());
+    struct stat st;
+    bool isRegular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    return add(loop(), { event, fd, file->value(), !isRegular, false,
+                         malValuePtr(file), callback });
+}
+
+int malEventLoop::watchProcess(malProcess* process, malValuePtr callback)
+{
+    int fd = process->exitFd();
+    MAL_CHECK(fd >= 0, "Cannot watch process %d", (int)process->pid());
+    return add(loop(), { EXITED, fd, NULL, true, true,
+                         malValuePtr(process), callback });
+}
+
+int malEventLoop::startTimer(int64_t milliseconds, int64_t interval,
+                             malValuePtr callback)
+{
+    Loop& l = loop();
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    MAL_CHECK(fd >= 0, "Cannot create timer: %s", strerror(errno));
+    // An it_value of 0 would disarm it rather than fire at once.
+    milliseconds = std::max<int64_t>(milliseconds, 0);
+    itimerspec spec = {};
+    spec.it_value.tv_sec = milliseconds / 1000;
+    spec.it_value.tv_nsec = milliseconds % 1000 * 1000000 + 1;
+    spec.it_interval.tv_sec = interval / 1000;
+    spec.it_interval.tv_nsec = interval % 1000 * 1000000;
+    if (timerfd_settime(fd, 0, &spec, NULL) != 0) {
+        int error = errno;
+        close(fd);
+        MAL_FAIL("Cannot start timer: %s", strerror(error));
+    }
+    return add(l, { TIMEOUT, fd, NULL, true, interval == 0,
+                    mal::nilValue(), callback });
+}
+
+bool malEventLoop::cancel(int id)
+{
+    Loop& l = loop();
+    auto found = l.watches.find(id);
+    if (found == l.watches.end()) {
+        return false;
+    }
+    remove(l, found);
+    return true;
+}
+
+int malEventLoop::run(int timeout)
+{
+    Loop& l = loop();
+    l.isStopped = false;
+    Clock::time_point deadline = Clock::now()
+                               + std::chrono::milliseconds(timeout);
+    epoll_event events[256];
+    int called = 0;
+    for (;;) {
+        sweep(l);
+        if (l.watches.empty() || l.isStopped) {
+            break;
+        }
+
+        // What is ready without asking epoll means not waiting for it.
+        std::vector<int> ready;
+        for (const auto& watch : l.watches) {
+            if (isReady(watch.second)) {
+                ready.push_back(watch.first);
+            }
+        }
+        int wait = -1;
+        if (!ready.empty()) {
+            wait = 0;
+        }
+        else if (timeout >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - Clock::now()).count();
+            wait = std::max<int64_t>(left, 0);
+        }
+        int count = epoll_wait(l.epollFd, events, 256, wait);
+        MAL_CHECK(count >= 0 || errno == EINTR, "Cannot wait for events: %s",
+                  strerror(errno));
+        for (int i = 0; i < count; i++) {
+            auto ids = l.byFd.find(events[i].data.fd);
+            if (ids == l.byFd.end()) {
+                continue;
+            }
+            // Hanging up or failing is news for readers and writers both.
+            uint32_t happened = events[i].events;
+            if (happened & (EPOLLHUP | EPOLLERR)) {
+                happened |= EPOLLIN | EPOLLOUT;
+            }
+            for (int id : ids->second) {
+                const Watch& watch = l.watches.at(id);
+                if ((happened & eventsOf(watch.event)) && !isReady(watch)) {
+                    ready.push_back(id);
+                }
+            }
+        }
+
+        // Callbacks may cancel, or add, any watch, this one included.
+        std::sort(ready.begin(), ready.end());
+        for (int id : ready) {
+            auto found = l.watches.find(id);
+            if (found == l.watches.end() || isStale(found->second)) {
+                continue;
+            }
+            if (found->second.event == TIMEOUT) {
+                uint64_t expirations;
+                if (read(found->second.fd, &expirations,
+                         sizeof(expirations)) < 0) {
+                    continue;   // not due after all
+                }
+            }
+            malValuePtr callback = found->second.callback;
+            if (found->second.isOneShot) {
+                remove(l, found);
+            }
+            malValueVec args(1, mal::integer(id));
+            APPLY(callback, args.begin(), args.end());
+            called++;
+            if (l.isStopped) {
+                break;
+            }
+        }
+        if (timeout >= 0 && Clock::now() >= deadline) {
+            break;
+        }
+    }
+    l.isStopped = false;
+    return called;
+}
+
+void malEventLoop::stop()
+{
+    loop().isStopped = true;
+}
+
+int malEventLoop::count()
+{
+    return loop().watches.size();
+}
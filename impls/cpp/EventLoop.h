@@ -0,0 +1,39 @@
+#ifndef INCLUDE_EVENTLOOP_H
+#define INCLUDE_EVENTLOOP_H
+
+#include "Types.h"
+
+class malProcess;
+
+// Waits on any number of files, pipes, sockets, processes and timers at
+// once, on the one thread, and calls back whatever became ready. Linux
+// only, through epoll, timerfd and pidfd.
+//
+// Each callback is called with the id of its watch. Watches for readable
+// and writable files stay until they are cancelled, or the file closed.
+// Those for a process ending, and timers that don't repeat, are gone
+// once they have fired. A regular file, which epoll can't wait on, is
+// always ready, as is a file holding input read ahead of its reader.
+class malEventLoop {
+public:
+    enum Event { READABLE, WRITABLE, EXITED, TIMEOUT };
+
+    // Each of these returns the id of the new watch.
+    static int watchFile(malFile* file, Event event, malValuePtr callback);
+    static int watchProcess(malProcess* process, malValuePtr callback);
+    // Fires after milliseconds, then every interval milliseconds if that
+    // isn't 0.
+    static int startTimer(int64_t milliseconds, int64_t interval,
+                          malValuePtr callback);
+    static bool cancel(int id);
+
+    // Calls back whatever is ready until nothing is being watched, stop()
+    // is called, or timeout milliseconds have passed, if it isn't
+    // negative. How many callbacks were called.
+    static int run(int timeout);
+    static void stop();
+
+    static int count();
+};
+
+#endif // INCLUDE_EVENTLOOP_H
@@ -0,0 +1,324 @@
+#include "FileCache.h"
+
+#include <chrono>
+#include <errno.h>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Entry {
+    malFileInfo info;
+    int watch;                  // on its directory, -1 if there is none
+    int selfWatch;              // on itself, for a directory
+    Clock::time_point expires;  // when it isn't watched
+};
+
+// A directory's own times change with what is made or removed in it,
+// which only a watch on the directory itself hears about.
+bool isWatched(const Entry& entry)
+{
+    return entry.watch >= 0
+        && (!entry.info.isDirectory || entry.selfWatch >= 0);
+}
+
+// Shared with the thread reading inotify events, under lock.
+struct Cache {
+    std::mutex lock;
+    bool isEnabled = false;
+    int ttl = malFileCache::DEFAULT_TTL;
+    String cwd;
+    std::unordered_map<String, Entry> entries;
+    std::unordered_map<String, int> watches;        // directory -> watch
+    std::unordered_map<int, String> directories;    // watch -> directory
+    uint64_t generation = 0;    // bumped whenever something is dropped
+    int notifyFd = -1;
+    bool hasTriedNotify = false;
+    malFileCacheStats stats = { 0, 0, 0, 0, 0 };
+};
+
+// Leaked, as the thread may still be using it at exit.
+Cache& cache()
+{
+    static Cache* instance = new Cache;
+    return *instance;
+}
+
+malFileInfo statPath(const String& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return { false, false, 0, 0 };
+    }
+    return { true, S_ISDIR(st.st_mode), (int64_t)st.st_size, st.st_mtime };
+}
+
+String keyOf(const Cache& c, const String& path)
+{
+    // Most paths asked about are absolute and normal already.
+    if (!path.empty() && path[0] == '/' && path.back() != '/'
+        && path.find("//") == String::npos
+        && path.find("/.") == String::npos) {
+        return path;
+    }
+    std::filesystem::path p(path);
+    if (p.is_relative()) {
+        p = std::filesystem::path(c.cwd) / p;
+    }
+    String key = p.lexically_normal().string();
+    while (key.size() > 1 && key.back() == '/') {
+        key.pop_back();
+    }
+    return key;
+}
+
+String directoryOf(const String& key)
+{
+    size_t slash = key.rfind('/');
+    return slash == 0 || slash == String::npos ? "/" : key.substr(0, slash);
+}
+
+String joinPath(const String& directory, const char* name)
+{
+    return directory == "/" ? "/" + String(name) : directory + "/" + name;
+}
+
+void dropEntry(Cache& c, const String& key)
+{
+    c.stats.invalidations += c.entries.erase(key);
+    c.generation++;
+}
+
+void dropAll(Cache& c)
+{
+    c.stats.invalidations += c.entries.size();
+    c.entries.clear();
+    c.generation++;
+}
+
+#ifdef __linux__
+
+void dropWatch(Cache& c, int watch)
+{
+    for (auto it = c.entries.begin(); it != c.entries.end(); ) {
+        if (it->second.watch == watch || it->second.selfWatch == watch) {
+            it = c.entries.erase(it);
+            c.stats.invalidations++;
+        }
+        else {
+            ++it;
+        }
+    }
+    auto directory = c.directories.find(watch);
+    if (directory != c.directories.end()) {
+        c.watches.erase(directory->second);
+        c.directories.erase(directory);
+    }
+    c.generation++;
+}
+
+void readEvents(int fd)
+{
+    alignas(inotify_event) char buffer[64 * 1024];
+    for (;;) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            return;
+        }
+        Cache& c = cache();
+        std::lock_guard<std::mutex> guard(c.lock);
+        for (char* at = buffer; at < buffer + length; ) {
+            const inotify_event* event = (const inotify_event*)at;
+            at += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                dropAll(c);
+                continue;
+            }
+            auto directory = c.directories.find(event->wd);
+            if (directory == c.directories.end()) {
+                continue;
+            }
+            if (event->mask & IN_MOVE_SELF) {
+                // The watch would follow the directory to its new name.
+                inotify_rm_watch(fd, event->wd);
+            }
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                dropWatch(c, event->wd);
+            }
+            else if (event->len > 0) {
+                dropEntry(c, joinPath(directory->second, event->name));
+                if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                   | IN_MOVED_TO)) {
+                    dropEntry(c, directory->second);
+                }
+            }
+            else {
+                dropEntry(c, directory->second);
+            }
+        }
+    }
+}
+
+int watchOf(Cache& c, const String& directory)
+{
+    auto found = c.watches.find(directory);
+    if (found != c.watches.end()) {
+        return found->second;
+    }
+    if (!c.hasTriedNotify) {
+        c.hasTriedNotify = true;
+        c.notifyFd = inotify_init1(IN_CLOEXEC);
+        if (c.notifyFd >= 0) {
+            std::thread(readEvents, c.notifyFd).detach();
+        }
+    }
+    int watch = -1;
+    if (c.notifyFd >= 0) {
+        watch = inotify_add_watch(c.notifyFd, directory.c_str(),
+                                  IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY
+                                  | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                  | IN_MOVED_TO | IN_DELETE_SELF
+                                  | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+    // A directory that can't be watched isn't tried again.
+    c.watches[directory] = watch;
+    if (watch >= 0) {
+        c.directories[watch] = directory;
+    }
+    return watch;
+}
+
+void removeWatches(Cache& c)
+{
+    for (const auto& directory : c.directories) {
+        inotify_rm_watch(c.notifyFd, directory.first);
+    }
+    c.watches.clear();
+    c.directories.clear();
+}
+
+#else
+
+int watchOf(Cache&, const String&)
+{
+    return -1;
+}
+
+void removeWatches(Cache&)
+{
+}
+
+#endif
+
+}
+
+malFileInfo malFileCache::lookup(const String& path)
+{
+    Cache& c = cache();
+    std::unique_lock<std::mutex> guard(c.lock);
+    if (!c.isEnabled) {
+        guard.unlock();
+        return statPath(path);
+    }
+    String key = keyOf(c, path);
+    Clock::time_point now = Clock::now();
+    auto found = c.entries.find(key);
+    if (found != c.entries.end()
+        && (isWatched(found->second) || now < found->second.expires)) {
+        c.stats.hits++;
+        return found->second.info;
+    }
+    c.stats.misses++;
+
+    // Watch first, so no change after the stat goes unseen, and keep what
+    // stat says only if nothing was dropped while it ran.
+    int watch = watchOf(c, directoryOf(key));
+    int selfWatch = -1;
+    uint64_t generation = c.generation;
+    guard.unlock();
+    malFileInfo info = statPath(key);
+    guard.lock();
+    if (info.isDirectory && c.isEnabled) {
+        // The same again with a watch on the directory itself.
+        selfWatch = watchOf(c, key);
+        generation = c.generation;
+        guard.unlock();
+        info = statPath(key);
+        guard.lock();
+    }
+    if (c.isEnabled && c.generation == generation) {
+        if (c.entries.size() >= MAX_ENTRIES) {
+            c.entries.clear();
+        }
+        c.entries[key] = {
+            info, watch, selfWatch, now + std::chrono::milliseconds(c.ttl)
+        };
+    }
+    return info;
+}
+
+void malFileCache::invalidate(const String& path)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    if (c.isEnabled) {
+        dropEntry(c, keyOf(c, path));
+    }
+}
+
+bool malFileCache::isEnabled()
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    return c.isEnabled;
+}
+
+void malFileCache::setEnabled(bool isEnabled)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    c.isEnabled = isEnabled;
+    c.entries.clear();
+    c.generation++;
+    removeWatches(c);
+    if (isEnabled) {
+        std::error_code error;
+        c.cwd = std::filesystem::current_path(error).string();
+    }
+}
+
+int malFileCache::ttl()
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    return c.ttl;
+}
+
+void malFileCache::setTtl(int milliseconds)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    c.ttl = milliseconds;
+}
+
+malFileCacheStats malFileCache::stats()
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> guard(c.lock);
+    malFileCacheStats stats = c.stats;
+    stats.entries = c.entries.size();
+    stats.watches = c.directories.size();
+    return stats;
+}
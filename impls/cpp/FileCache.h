@@ -0,0 +1,52 @@
+#ifndef INCLUDE_FILECACHE_H
+#define INCLUDE_FILECACHE_H
+
+#include "MAL.h"
+
+#include <stdint.h>
+#include <time.h>
+
+// What the vl-file-* builtins want to know about a path.
+struct malFileInfo {
+    bool exists;
+    bool isDirectory;
+    int64_t size;
+    time_t modified;
+};
+
+struct malFileCacheStats {
+    int64_t hits;
+    int64_t misses;
+    int64_t invalidations;  // entries dropped because their path changed
+    int64_t entries;
+    int64_t watches;        // directories watched through inotify
+};
+
+// Remembers what stat said about paths, keyed by their absolute, normal
+// form, so asking again is a hash lookup. Off unless turned on.
+//
+// On Linux the directory holding each path is watched through inotify,
+// by a thread that drops the entries of whatever changes there, and so is
+// a directory itself, for what is made or removed in it. Changes
+// made from here are dropped at once. Changes made elsewhere show up as
+// soon as that thread has seen them, which is the only delay. Paths that
+// can't be watched, and every path elsewhere, are kept for ttl()
+// milliseconds instead.
+class malFileCache {
+public:
+    static malFileInfo lookup(const String& path);
+    // Forgets path, which was just changed from here.
+    static void invalidate(const String& path);
+
+    static bool isEnabled();
+    // Either way, the cache starts out empty.
+    static void setEnabled(bool isEnabled);
+    static int ttl();
+    static void setTtl(int milliseconds);
+
+    static malFileCacheStats stats();
+
+    enum { DEFAULT_TTL = 1000, MAX_ENTRIES = 64 * 1024 };
+};
+
+#endif // INCLUDE_FILECACHE_H
@@ -16,8 +16,11 @@ typedef malValueVec::iterator    malValueIter;
 class malEnv;
 typedef RefCountedPtr<malEnv>    malEnvPtr;
 
+class malParams;
+typedef RefCountedPtr<malParams> malParamsPtr;
+
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
@@ -28,5 +31,10 @@ extern void installCore(malEnvPtr env);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
+extern malValueVec* readForms(const String& input);
+
+// DataReader.cpp
+extern malValuePtr readData(std::string_view input);
+extern malValueVec* readDataForms(std::string_view input);
 
 #endif // INCLUDE_MAL_H
@@ -0,0 +1,294 @@
+#include "Printer.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <charconv>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+malOutputPort::malOutputPort(::FILE* file, size_t bufferSize)
+: m_file(file)
+, m_bufferSize(0)
+, m_hasWritten(false)
+{
+    setBufferSize(bufferSize);
+}
+
+void malOutputPort::setBufferSize(size_t size)
+{
+    MAL_CHECK(size > 0, "Buffer size must be positive");
+    MAL_CHECK(!m_hasWritten, "Output has already been written");
+    // stdio ignores the size unless it is given the buffer too.
+    std::unique_ptr<char[]> buffer(new char[size]);
+    int mode = isatty(fileno(m_file)) ? _IOLBF : _IOFBF;
+    setvbuf(m_file, buffer.get(), mode, size);
+    m_buffer.swap(buffer);
+    m_bufferSize = size;
+}
+
+static void flushConsole()
+{
+    malOutputPort::console().flush();
+}
+
+// Leaked, so it outlives whatever still prints from static destructors.
+malOutputPort& malOutputPort::console()
+{
+    static malOutputPort* port = NULL;
+    if (!port) {
+        port = new malOutputPort(stdout, DEFAULT_BUFFER_SIZE);
+        atexit(flushConsole);
+    }
+    return *port;
+}
+
+// Made before main, so stdout gets its buffer before anything is written
+// to it, through the console or not.
+static malOutputPort& s_console = malOutputPort::console();
+
+malPrinter::malPrinter(String& out)
+: m_out(out)
+, m_port(NULL)
+, m_maxLength(-1)
+, m_maxLevel(-1)
+{
+}
+
+malPrinter::malPrinter(malOutputPort& port)
+: m_out(m_buffer)
+, m_port(&port)
+, m_maxLength(-1)
+, m_maxLevel(-1)
+{
+}
+
+malPrinter::~malPrinter()
+{
+    if (m_port) {
+        flush();
+    }
+}
+
+// The value of a limit variable, or -1 when it is unset or nil.
+static int limitOf(const malEnvPtr& env, const String& name)
+{
+    malEnvPtr found = env->find(name);
+    if (!found) {
+        return -1;
+    }
+    malValuePtr value = found->get(name);
+    if (const malInteger* i = DYNAMIC_CAST(malInteger, value)) {
+        return i->value() < 0 ? 0 : (int)i->value();
+    }
+    return -1;
+}
+
+void malPrinter::limitBy(const malEnvPtr& env)
+{
+    m_maxLength = limitOf(env, "*print-length*");
+    m_maxLevel = limitOf(env, "*print-level*");
+}
+
+void malPrinter::flush()
+{
+    if (m_port && !m_out.empty()) {
+        m_port->write(m_out);
+        m_out.clear();
+    }
+}
+
+void malPrinter::writeInteger(int64_t value)
+{
+    char buffer[24];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    write(std::string_view(buffer, result.ptr - buffer));
+}
+
+void malPrinter::writeDouble(double value)
+{
+    // Same as the "%f" std::to_string used, which the tests rely on.
+    char buffer[400];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value,
+                                std::chars_format::fixed, 6);
+    write(std::string_view(buffer, result.ptr - buffer));
+}
+
+void malPrinter::writeEscaped(std::string_view text)
+{
+    write('"');
+    size_t start = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        const char* escaped = NULL;
+        switch (text[i]) {
+            case '\\': escaped = "\\\\"; break;
+            case '\n': escaped = "\\n";  break;
+            case '"':  escaped = "\\\""; break;
+        }
+        if (escaped) {
+            write(text.substr(start, i - start));
+            write(escaped);
+            start = i + 1;
+        }
+    }
+    write(text.substr(start));
+    write('"');
+}
+
+void malPrinter::printLeaf(const malValue* value, bool readably)
+{
+    // Switching on type() is a lot cheaper than a chain of dynamic_casts.
+    switch (value->type()) {
+        case MALTYPE::INT:
+            writeInteger(static_cast<const malInteger*>(value)->value());
+            return;
+        case MALTYPE::REAL:
+            writeDouble(static_cast<const malDouble*>(value)->value());
+            return;
+        case MALTYPE::STR: {
+            std::string_view text = static_cast<const malString*>(value)->view();
+            if (readably) {
+                writeEscaped(text);
+            }
+            else {
+                write(text);
+            }
+            return;
+        }
+        case MALTYPE::SYM:
+            write(static_cast<const malSymbol*>(value)->value());
+            return;
+        case MALTYPE::KEYW:
+            write(static_cast<const malKeyword*>(value)->view());
+            return;
+        default:
+            break;
+    }
+    if (const malStringBuilder* b =
+            dynamic_cast<const malStringBuilder*>(value)) {
+        if (readably) {
+            write("(string-builder ");
+            writeEscaped(b->view());
+            write(')');
+        }
+        else {
+            write(b->view());
+        }
+    }
+    else {
+        write(value->print(readably));
+    }
+}
+
+namespace {
+
+// A container part way through being printed.
+bool isContainer(const malValue* value, MALTYPE type)
+{
+    switch (type) {
+        case MALTYPE::LIST:
+        case MALTYPE::VEC:
+        case MALTYPE::MAP:
+        case MALTYPE::ATOM:
+            return true;
+        case MALTYPE::UNDEF:
+            return dynamic_cast<const malCell*>(value) != NULL;
+        default:
+            return false;
+    }
+}
+
+struct Frame {
+    enum Kind { SEQUENCE, HASH, WRAPPER };
+
+    Kind kind;
+    const malValue* value;
+    const char* close;
+    size_t next;                            // items printed so far
+    malHash::Map::const_iterator entry;     // HASH: next entry
+};
+
+}
+
+void malPrinter::print(const malValue* value, bool readably)
+{
+    std::vector<Frame> stack;
+    while (value) {
+        // Open whatever comes next, leaves are written in one go.
+        MALTYPE type = value->type();
+        if (m_maxLevel >= 0 && stack.size() >= (size_t)m_maxLevel
+            && isContainer(value, type)) {
+            write('#');
+        }
+        else if (type == MALTYPE::LIST || type == MALTYPE::VEC) {
+            bool isList = type == MALTYPE::LIST;
+            write(isList ? '(' : '[');
+            stack.push_back({ Frame::SEQUENCE, value, isList ? ")" : "]", 0 });
+        }
+        else if (type == MALTYPE::MAP) {
+            const malHash* hash = static_cast<const malHash*>(value);
+            write('{');
+            stack.push_back({ Frame::HASH, hash, "}", 0, hash->map().begin() });
+        }
+        else if (type == MALTYPE::ATOM) {
+            write("(atom ");
+            stack.push_back({ Frame::WRAPPER, value, ")", 0 });
+        }
+        else if (type == MALTYPE::UNDEF && dynamic_cast<const malCell*>(value)) {
+            write("#<cell ");
+            stack.push_back({ Frame::WRAPPER, value, ">", 0 });
+        }
+        else {
+            printLeaf(value, readably);
+        }
+
+        // Then find the next value, closing the containers that are done.
+        value = NULL;
+        while (!value && !stack.empty()) {
+            Frame& top = stack.back();
+            if (top.kind == Frame::SEQUENCE) {
+                const malSequence* seq =
+                    static_cast<const malSequence*>(top.value);
+                if (top.next < (size_t)seq->count()) {
+                    if (top.next > 0) {
+                        write(' ');
+                    }
+                    if (isPastLength(top.next)) {
+                        write("...");
+                    }
+                    else {
+                        value = seq->item(top.next++).ptr();
+                        continue;
+                    }
+                }
+            }
+            else if (top.kind == Frame::HASH) {
+                const malHash* hash = static_cast<const malHash*>(top.value);
+                if (top.entry != hash->map().end()) {
+                    if (top.next > 0) {
+                        write(' ');
+                    }
+                    if (isPastLength(top.next)) {
+                        write("...");
+                    }
+                    else {
+                        write(top.entry->first);
+                        write(' ');
+                        value = top.entry->second.ptr();
+                        ++top.entry;
+                        ++top.next;
+                        continue;
+                    }
+                }
+            }
+            else if (top.next++ == 0) {
+                value = top.value->type() == MALTYPE::ATOM
+                    ? static_cast<const malAtom*>(top.value)->deref().ptr()
+                    : static_cast<const malCell*>(top.value)->value().ptr();
+                continue;
+            }
+            write(top.close);
+            stack.pop_back();
+        }
+    }
+}
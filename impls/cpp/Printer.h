@@ -0,0 +1,104 @@
+#ifndef INCLUDE_PRINTER_H
+#define INCLUDE_PRINTER_H
+
+#include "MAL.h"
+
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string_view>
+
+// Where console output ends up: stdio's stream, given a buffer of a size
+// of our choosing, which is written out when it fills up, on flush() and
+// at exit. A terminal is line buffered instead, so what is printed shows
+// up as it is printed.
+class malOutputPort {
+public:
+    malOutputPort(::FILE* file, size_t bufferSize);
+
+    void write(std::string_view text) {
+        m_hasWritten = true;
+        fwrite(text.data(), 1, text.size(), m_file);
+    }
+    void write(char c) {
+        m_hasWritten = true;
+        fputc(c, m_file);
+    }
+    void flush() { fflush(m_file); }
+
+    size_t bufferSize() const { return m_bufferSize; }
+    // Switches to a buffer of size bytes. stdio only allows that before
+    // the file is first used, so it fails once anything has been written.
+    void setBufferSize(size_t size);
+
+    ::FILE* file() const { return m_file; }
+
+    // stdout.
+    static malOutputPort& console();
+
+    enum { DEFAULT_BUFFER_SIZE = 64 * 1024 };
+
+private:
+    malOutputPort(const malOutputPort&); // no copy ctor
+
+    ::FILE* m_file;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_bufferSize;
+    bool m_hasWritten;
+};
+
+// Prints values straight into one buffer, walking nested sequences and
+// hashes with a stack of its own rather than recursing, so every byte
+// is written once however deep the structure is.
+class malPrinter {
+public:
+    // Appends to out.
+    malPrinter(String& out);
+    // Writes to port, in chunks of up to FLUSH_SIZE bytes and when the
+    // printer goes away.
+    malPrinter(malOutputPort& port);
+    ~malPrinter();
+
+    // Follows *print-length* and *print-level* as set in env: past the
+    // first, the rest of a sequence or hash shows as "...", and past the
+    // second, a whole container shows as "#".
+    void limitBy(const malEnvPtr& env);
+
+    void print(const malValue* value, bool readably);
+    void print(const malValuePtr& value, bool readably) {
+        print(value.ptr(), readably);
+    }
+
+    void write(std::string_view text) {
+        m_out.append(text);
+        if (m_port && m_out.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+    void write(char c) { write(std::string_view(&c, 1)); }
+    void writeInteger(int64_t value);
+    void writeDouble(double value);
+    // Quoted, with the escapes the reader understands.
+    void writeEscaped(std::string_view text);
+
+    // Hands what was written so far to the port.
+    void flush();
+
+private:
+    malPrinter(const malPrinter&); // no copy ctor
+
+    void printLeaf(const malValue* value, bool readably);
+    bool isPastLength(size_t count) const {
+        return m_maxLength >= 0 && count >= (size_t)m_maxLength;
+    }
+
+    enum { FLUSH_SIZE = 64 * 1024 };
+
+    String m_buffer;
+    String& m_out;
+    malOutputPort* m_port;
+    int m_maxLength;
+    int m_maxLevel;
+};
+
+#endif // INCLUDE_PRINTER_H
@@ -0,0 +1,375 @@
+#include "Process.h"
+#include "Printer.h"
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char** environ;
+
+// Processes let go of while still running, to be reaped once they end so
+// they don't linger as zombies. Leaked, so a process dropped during static
+// destruction still has somewhere to go.
+static std::vector<pid_t>& dropped()
+{
+    static std::vector<pid_t>* pids = new std::vector<pid_t>;
+    return *pids;
+}
+
+// Reaps whichever of the dropped processes have ended since.
+static void reapDropped()
+{
+    auto& pids = dropped();
+    for (size_t i = 0; i < pids.size(); ) {
+        pid_t pid = waitpid(pids[i], NULL, WNOHANG);
+        if (pid == pids[i] || (pid < 0 && errno == ECHILD)) {
+            pids[i] = pids.back();
+            pids.pop_back();
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+struct malProcess::State {
+    State() : pid(-1), exitFd(-1), status(0), hasExited(false) { }
+    ~State() {
+        if (exitFd >= 0) {
+            close(exitFd);
+        }
+        if (pid > 0 && !hasExited && waitpid(pid, NULL, WNOHANG) == 0) {
+            dropped().push_back(pid);
+        }
+    }
+
+    String name;
+    pid_t pid;
+    int exitFd;
+    int status;
+    bool hasExited;
+    malValuePtr files[3];
+};
+
+static int statusOf(int status)
+{
+    return WIFSIGNALED(status) ? -WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Starts argv with each of its streams set up as asked, filling in state.
+// 0, or the errno saying why it couldn't be started.
+static int spawn(const StringVec& argv, const malProcess::Stream streams[3],
+                 malProcess::State& state)
+{
+    reapDropped();
+    // What is buffered for our stdout has to come before theirs.
+    malOutputPort::console().flush();
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+    int error = 0;
+    for (int i = 0; i < 3 && error == 0; i++) {
+        if (streams[i] == malProcess::PIPE) {
+            if (pipe2(pipes[i], O_CLOEXEC) != 0) {
+                error = errno;
+                break;
+            }
+            // dup2 clears close-on-exec on the child's copy.
+            posix_spawn_file_actions_adddup2(&actions, pipes[i][i == 0 ? 0 : 1],
+                                             i);
+        }
+        else if (streams[i] == malProcess::DISCARD) {
+            posix_spawn_file_actions_addopen(&actions, i, "/dev/null",
+                                             i == 0 ? O_RDONLY : O_WRONLY, 0);
+        }
+    }
+
+    std::vector<char*> args;
+    for (const auto& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(NULL);
+    if (error == 0) {
+        error = posix_spawnp(&state.pid, args[0], &actions, NULL,
+                             args.data(), environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    for (int i = 0; i < 3; i++) {
+        if (pipes[i][0] < 0) {
+            continue;
+        }
+        int ours = i == 0 ? 1 : 0;
+        close(pipes[i][1 - ours]);
+        if (error != 0) {
+            close(pipes[i][ours]);
+            continue;
+        }
+        static const char* names[] = { ":stdin", ":stdout", ":stderr" };
+        String path = argv[0] + names[i];
+        char mode = i == 0 ? 'w' : 'r';
+        ::FILE* file = fdopen(pipes[i][ours], i == 0 ? "w" : "r");
+        state.files[i] = malValuePtr(new malFile(path.c_str(), mode, file));
+    }
+    if (error != 0) {
+        state.pid = -1;
+        return error;
+    }
+    state.name = argv[0];
+#ifdef SYS_pidfd_open
+    state.exitFd = syscall(SYS_pidfd_open, state.pid, 0);
+#endif
+    return 0;
+}
+
+// Whether the process has ended, waiting up to timeout milliseconds.
+static bool reap(malProcess::State& state, int timeout)
+{
+    if (state.hasExited) {
+        return true;
+    }
+    if (state.exitFd >= 0 && timeout != 0) {
+        pollfd fd = { state.exitFd, POLLIN, 0 };
+        int ready;
+        while ((ready = poll(&fd, 1, timeout)) < 0 && errno == EINTR) {
+        }
+        if (ready == 0) {
+            return false;
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now()
+                  + std::chrono::milliseconds(timeout);
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(state.pid, &status,
+                            state.exitFd >= 0 || timeout == 0 ? WNOHANG : 0);
+        if (pid == state.pid) {
+            state.status = statusOf(status);
+            state.hasExited = true;
+            return true;
+        }
+        if (pid < 0 && errno == EINTR) {
+            continue;
+        }
+        if (pid < 0) {
+            // Reaped by someone else, we won't learn how it went.
+            state.status = -1;
+            state.hasExited = true;
+            return true;
+        }
+        // Without a pidfd, check back every millisecond.
+        if (timeout == 0
+            || (timeout > 0 && std::chrono::steady_clock::now() >= deadline)) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+malProcess::malProcess(const StringVec& argv, Stream in, Stream out,
+                       Stream err)
+: m_state(new State)
+{
+    MAL_CHECK(!argv.empty(), "Nothing to run");
+    const Stream streams[3] = { in, out, err };
+    int error = spawn(argv, streams, *m_state);
+    MAL_CHECK(error == 0, "Cannot run %s: %s", argv[0].c_str(),
+              strerror(error));
+}
+
+pid_t malProcess::pid() const
+{
+    return m_state->pid;
+}
+
+int malProcess::exitFd() const
+{
+    return m_state->exitFd;
+}
+
+malValuePtr malProcess::wait(int timeout)
+{
+    bool hasExited = reap(*m_state, timeout);
+    reapDropped();
+    if (!hasExited) {
+        return mal::nilValue();
+    }
+    return mal::integer(m_state->status);
+}
+
+malValuePtr malProcess::input() const
+{
+    return m_state->files[0] ? m_state->files[0] : mal::nilValue();
+}
+
+malValuePtr malProcess::output() const
+{
+    return m_state->files[1] ? m_state->files[1] : mal::nilValue();
+}
+
+malValuePtr malProcess::errors() const
+{
+    return m_state->files[2] ? m_state->files[2] : mal::nilValue();
+}
+
+String malProcess::print(bool) const
+{
+    return "#<process " + std::to_string(m_state->pid) + " "
+         + escape(m_state->name) + ">";
+}
+
+malValuePtr malProcess::run(const StringVec& argv)
+{
+    const Stream inherit[3] = { INHERIT, INHERIT, INHERIT };
+    State state;
+    if (argv.empty() || spawn(argv, inherit, state) != 0) {
+        return mal::nilValue();
+    }
+    reap(state, -1);
+    return mal::integer(state.status);
+}
+
+malValuePtr malProcess::runParallel(const std::vector<StringVec>& commands,
+                                    int jobs)
+{
+    const Stream inherit[3] = { INHERIT, INHERIT, INHERIT };
+    malValueVec* results = new malValueVec(commands.size(), mal::nilValue());
+    std::vector<std::pair<size_t, std::unique_ptr<State>>> running;
+    size_t next = 0;
+    while (next < commands.size() || !running.empty()) {
+        while ((int)running.size() < jobs && next < commands.size()) {
+            std::unique_ptr<State> state(new State);
+            if (!commands[next].empty()
+                && spawn(commands[next], inherit, *state) == 0) {
+                running.emplace_back(next, std::move(state));
+            }
+            next++;
+        }
+        if (running.empty()) {
+            continue;
+        }
+
+        // Sleep until one of them ends, if they all have pidfds.
+        std::vector<pollfd> fds;
+        for (const auto& job : running) {
+            if (job.second->exitFd >= 0) {
+                fds.push_back({ job.second->exitFd, POLLIN, 0 });
+            }
+        }
+        if (fds.size() == running.size()) {
+            while (poll(fds.data(), fds.size(), -1) < 0 && errno == EINTR) {
+            }
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        for (size_t i = 0; i < running.size(); ) {
+            State& state = *running[i].second;
+            if (reap(state, 0)) {
+                (*results)[running[i].first] = mal::integer(state.status);
+                running.erase(running.begin() + i);
+            }
+            else {
+                i++;
+            }
+        }
+    }
+    return mal::list(results);
+}
+
+bool malProcess::splitCommand(const String& command, StringVec& argv)
+{
+    argv.clear();
+    String word;
+    bool inWord = false;
+    for (size_t i = 0; i < command.size(); i++) {
+        char c = command[i];
+        if (c == '\'') {
+            size_t end = command.find('\'', i + 1);
+            if (end == String::npos) {
+                return false;
+            }
+            word.append(command, i + 1, end - i - 1);
+            inWord = true;
+            i = end;
+        }
+        else if (c == '"') {
+            // Only \ is left to deal with, $ and ` need the shell.
+            inWord = true;
+            for (i++; i < command.size() && command[i] != '"'; i++) {
+                if (command[i] == '$' || command[i] == '`') {
+                    return false;
+                }
+                if (command[i] == '\\' && i + 1 < command.size()
+                    && strchr("\"\\$`", command[i + 1])) {
+                    i++;
+                }
+                word += command[i];
+            }
+            if (i == command.size()) {
+                return false;
+            }
+        }
+        else if (c == '\\') {
+            if (++i == command.size()) {
+                return false;
+            }
+            word += command[i];
+            inWord = true;
+        }
+        else if (c == ' ' || c == '\t') {
+            if (inWord) {
+                argv.push_back(word);
+                word.clear();
+                inWord = false;
+            }
+        }
+        else if (strchr("|&;<>()$`*?[]{}!\n~#", c)) {
+            return false;
+        }
+        else {
+            word += c;
+            inWord = true;
+        }
+    }
+    if (inWord) {
+        argv.push_back(word);
+    }
+    if (argv.empty()) {
+        return false;
+    }
+    // An assignment, builtin or keyword has no program to run in its
+    // place, or would only change a shell that is gone at once.
+    static const char* shellWords[] = {
+        ".", ":", "alias", "bg", "break", "case", "cd", "command",
+        "continue", "do", "done", "elif", "else", "esac", "eval", "exec",
+        "exit", "export", "fg", "fi", "for", "function", "getopts", "hash",
+        "if", "in", "jobs", "local", "read", "readonly", "return", "select",
+        "set", "shift", "source", "then", "time", "times", "trap", "type",
+        "ulimit", "umask", "unalias", "unset", "until", "wait", "while"
+    };
+    for (const char* shellWord : shellWords) {
+        if (argv[0] == shellWord) {
+            return false;
+        }
+    }
+    return argv[0].find('=') == String::npos;
+}
+
+StringVec malProcess::commandArgv(const String& command)
+{
+    StringVec argv;
+    if (!splitCommand(command, argv)) {
+        argv = { "/bin/sh", "-c", command };
+    }
+    return argv;
+}
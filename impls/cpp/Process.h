@@ -0,0 +1,67 @@
+#ifndef INCLUDE_PROCESS_H
+#define INCLUDE_PROCESS_H
+
+#include "Types.h"
+
+#include <memory>
+#include <sys/types.h>
+#include <vector>
+
+// A program started with posix_spawn, straight from an argv rather than
+// through /bin/sh. Each of its standard streams is inherited, connected
+// to /dev/null, or piped to a malFile of ours.
+class malProcess : public malValue {
+public:
+    enum Stream { INHERIT, PIPE, DISCARD };
+
+    // Throws if argv[0] can't be run. It is looked up in PATH.
+    malProcess(const StringVec& argv, Stream in, Stream out, Stream err);
+    malProcess(const malProcess& that, malValuePtr meta)
+        : malValue(meta), m_state(that.m_state) { }
+
+    pid_t pid() const;
+    // Becomes readable once the process has ended, -1 where pidfds aren't
+    // supported.
+    int exitFd() const;
+    // Waits up to timeout milliseconds for the process to end, forever if
+    // timeout is negative. Its exit status, or the signal that killed it,
+    // negated, or nil while it is still running.
+    malValuePtr wait(int timeout);
+
+    // A malFile for each piped stream, nil for the others.
+    malValuePtr input() const;
+    malValuePtr output() const;
+    malValuePtr errors() const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malProcess);
+
+    // Runs argv sharing our streams and waits for it. Its exit status, or
+    // nil if it couldn't be started.
+    static malValuePtr run(const StringVec& argv);
+
+    // Runs each command, up to jobs of them at a time, sharing our
+    // streams. Their exit statuses in order, nil for any that couldn't
+    // be started.
+    static malValuePtr runParallel(const std::vector<StringVec>& commands,
+                                   int jobs);
+
+    // The words of command, if splitting it into words and taking out
+    // quotes is all sh would do with it. false if it needs the shell.
+    static bool splitCommand(const String& command, StringVec& argv);
+
+    // command run as startapp gets it: through sh only if it needs it.
+    static StringVec commandArgv(const String& command);
+
+    struct State;
+
+private:
+    std::shared_ptr<State> m_state;
+};
+
+#endif // INCLUDE_PROCESS_H
@@ -132,6 +132,16 @@ malValuePtr readStr(const String& input)
     return readForm(tokeniser);
 }
 
+malValueVec* readForms(const String& input)
+{
+    Tokeniser tokeniser(input);
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    while (!tokeniser.eof()) {
+        items->push_back(readForm(tokeniser));
+    }
+    return items.release();
+}
+
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "expected form, got EOF");
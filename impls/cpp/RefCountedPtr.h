@@ -5,20 +5,81 @@
 
 #include <cstddef>
 
+#if DEBUG_REFCOUNT_STATS
+    #define COUNT_REFCOUNT_OP(counter) counter++
+#else
+    #define COUNT_REFCOUNT_OP(counter) NOOP
+#endif
+
+class RefVisitor;
+
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    // Per-object bits, kept in the padding after the refcount.
+    enum Flag {
+        HAS_PARAMS = 1 << 0,    // has a compiled malParams side entry
+        IS_CELL    = 1 << 1,    // malCell holding a captured binding
+        GC_CONTAINER = 1 << 2,  // may reference others, see traverse()
+        IMMORTAL   = 1 << 3,    // never counted or freed, e.g. nil
+        HAS_META   = 1 << 4,    // has a malValue side entry, see meta()
+        SHARES_ITEMS = 1 << 5,  // malSequence borrowing another's items
+        IS_ROPE    = 1 << 6,    // malString not flattened yet
+    };
+
+    RefCounted() : m_refCount(0), m_flags(0) { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
+    const RefCounted* acquire() const {
+        if (!hasFlag(IMMORTAL)) {
+            COUNT_REFCOUNT_OP(s_acquires);
+            m_refCount++;
+        }
+        return this;
+    }
+    int release() const {
+        if (hasFlag(IMMORTAL)) {
+            return 1;
+        }
+        COUNT_REFCOUNT_OP(s_releases);
+        return --m_refCount;
+    }
     int refCount() const { return m_refCount; }
 
+#if DEBUG_REFCOUNT_STATS
+    static unsigned long s_acquires;
+    static unsigned long s_releases;
+#endif
+
+    bool hasFlag(Flag flag) const { return (m_flags & flag) != 0; }
+    void setFlag(Flag flag) const { m_flags |= flag; }
+    void clearFlag(Flag flag) const { m_flags &= ~flag; }
+
+    // Reports every counted reference this object holds, for the cycle
+    // collector. Only called on objects flagged GC_CONTAINER.
+    virtual void traverse(RefVisitor& visitor) const { }
+
+    // Deletes an object whose count dropped to zero. Whatever it releases
+    // in turn is queued and deleted by the same loop, so dropping a deeply
+    // nested structure doesn't recurse once per level. With a budget set,
+    // a single drop deletes at most that many objects and the rest wait
+    // for the next drain().
+    static void reclaim(const RefCounted* object);
+    // Deletes queued objects, at most budget of them if it is positive.
+    // Returns how many are left.
+    static int drain(int budget);
+    static int pending() { return s_pending; }
+    static int reclaimBudget() { return s_reclaimBudget; }
+    static void setReclaimBudget(int budget) { s_reclaimBudget = budget; }
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
     mutable int m_refCount;
+    mutable unsigned char m_flags;
+
+    static int s_pending;
+    static int s_reclaimBudget;
 };
 
 template<class T>
@@ -32,8 +93,26 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving hands the reference over, nothing is counted.
+    RefCountedPtr(RefCountedPtr&& rhs) noexcept : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
-        acquire(rhs.m_object);
+        if (m_object != rhs.m_object) {
+            acquire(rhs.m_object);
+        }
+        return *this;
+    }
+
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) noexcept {
+        if (this != &rhs) {
+            T* object = m_object;
+            m_object = rhs.m_object;
+            rhs.m_object = 0;
+            if ((object != NULL) && (object->release() == 0)) {
+                RefCounted::reclaim(object);
+            }
+        }
         return *this;
     }
 
@@ -67,11 +146,23 @@ private:
 
     void release() {
         if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+            RefCounted::reclaim(m_object);
         }
     }
 
     T* m_object;
 };
 
+class RefVisitor {
+public:
+    virtual void visit(const RefCounted* object) = 0;
+
+    template<class T>
+    void operator () (const RefCountedPtr<T>& ptr) {
+        if (ptr) {
+            visit(ptr.ptr());
+        }
+    }
+};
+
 #endif // INCLUDE_REFCOUNTEDPTR_H
@@ -1,19 +1,80 @@
 #include "Debug.h"
 #include "Environment.h"
+#include "FileCache.h"
+#include "Printer.h"
 #include "Types.h"
+#include "DirectoryWalker.h"
 
 #include <iostream>
 #include <algorithm>
 #include <memory>
+#include <new>
 #include <typeinfo>
 #include <math.h>
+#include <string.h>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef std::unordered_map<const malSequence*, malParamsPtr> ParamsTable;
+
+// Compiled parameter lists, keyed by the binding list they came from.
+// Entries are dropped when that node is destroyed. Never freed, as
+// sequences may still be released by other static destructors at exit.
+static ParamsTable& paramsTable()
+{
+    static ParamsTable* table = new ParamsTable;
+    return *table;
+}
+
+// Hardly any value has metadata, so rather than a field in each one it
+// lives here, flagged HAS_META on the value and dropped along with it.
+// A sequence made by with-meta also keeps the one that owns the items
+// it shares alive from here.
+struct MetaEntry {
+    malValuePtr meta;
+    malValuePtr items;
+};
+
+typedef std::unordered_map<const malValue*, MetaEntry> MetaTable;
+
+static MetaTable& metaTable()
+{
+    static MetaTable* table = new MetaTable;
+    return *table;
+}
+
+static MetaEntry& metaEntry(const malValue* value)
+{
+    value->setFlag(RefCounted::HAS_META);
+    return metaTable()[value];
+}
+
+// Shared constants are never counted, so passing them around is free.
+static malValue* immortal(malValue* value)
+{
+    value->setFlag(RefCounted::IMMORTAL);
+    return value;
+}
+
+// Anything that can hold other values is printed by malPrinter, which
+// doesn't recurse however deeply they are nested.
+static String printValue(const malValue* value, bool readably)
+{
+    String out;
+    malPrinter(out).print(value, readably);
+    return out;
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
         return malValuePtr(new malAtom(value));
     };
 
-    malValuePtr boolean(bool value) {
+    const malValuePtr& boolean(bool value) {
         return value ? trueValue() : falseValue();
     }
 
@@ -54,9 +115,26 @@ namespace mal {
         return malValuePtr(new malBuiltIn(eval, name));
     };
 
-    malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
+    malValuePtr bytes(size_t size) {
+        return malValuePtr(new malBytes(size));
+    }
+
+    malValuePtr bytes(std::string_view bytes) {
+        return malValuePtr(new malBytes(bytes));
+    }
+
+    malValuePtr cell(malValuePtr value) {
+        return malValuePtr(new malCell(value));
+    };
+
+    malValuePtr directorySeq(const String& root, const String& pattern,
+                             int kinds) {
+        return malValuePtr(new malDirectorySeq(root, pattern, kinds));
+    }
+
+    const malValuePtr& falseValue() {
+        static malValuePtr c(immortal(new malConstant("false")));
+        return c;
     };
 
     malValuePtr file(const char *path, const char &mode)
@@ -64,10 +142,19 @@ namespace mal {
         return malValuePtr(new malFile(path, mode));
     };
 
+    malValuePtr lineSeq(malValuePtr file, bool ownsFile)
+    {
+        return malValuePtr(new malLineSeq(file, ownsFile));
+    };
+
     malValuePtr hash(const malHash::Map& map) {
         return malValuePtr(new malHash(map));
     }
 
+    malValuePtr hash(malHash::Map&& map) {
+        return malValuePtr(new malHash(std::move(map)));
+    }
+
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated) {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
@@ -81,7 +168,7 @@ namespace mal {
         return integer(std::stoi(token));
     };
 
-    malValuePtr keyword(const String& token) {
+    malValuePtr keyword(std::string_view token) {
         return malValuePtr(new malKeyword(token));
     };
 
@@ -90,6 +177,11 @@ namespace mal {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lambda(malParamsPtr params,
+                       malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(params, body, env));
+    }
+
     malValuePtr list(malValueVec* items) {
         return malValuePtr(new malList(items));
     };
@@ -123,14 +215,14 @@ namespace mal {
         return malValuePtr(new malLambda(lambda, true));
     };
 
-    malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
+    const malValuePtr& nilValue() {
+        static malValuePtr c(immortal(new malConstant("nil")));
+        return c;
     };
 
-    malValuePtr nullValue() {
-        static malValuePtr c(new malConstant(""));
-        return malValuePtr(c);
+    const malValuePtr& nullValue() {
+        static malValuePtr c(immortal(new malConstant("")));
+        return c;
     };
 
     malValuePtr mdouble(double value)
@@ -143,71 +235,83 @@ namespace mal {
         return mdouble(std::stof(token));
     };
 
-    malValuePtr piValue() {
-        static malValuePtr c(new malDouble(M_PI));
-        return malValuePtr(c);
+    const malValuePtr& piValue() {
+        static malValuePtr c(immortal(new malDouble(M_PI)));
+        return c;
     };
 
-    malValuePtr string(const String& token) {
+    malValuePtr rope(malValueVec&& pieces, size_t length) {
+        return malValuePtr(new malString(std::move(pieces), length));
+    }
+
+    malValuePtr string(std::string_view token) {
         return malValuePtr(new malString(token));
     }
 
+    malValuePtr string(const malStringBuffer* buffer) {
+        return malValuePtr(new malString(buffer));
+    }
+
+    malValuePtr stringBuilder() {
+        return malValuePtr(new malStringBuilder);
+    }
+
     malValuePtr symbol(const String& token) {
         return malValuePtr(new malSymbol(token));
     };
 
-    malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
+    const malValuePtr& trueValue() {
+        static malValuePtr c(immortal(new malConstant("true")));
+        return c;
     };
 
-    malValuePtr typeAtom() {
-        static malValuePtr c(new malConstant("ATOM"));
-        return malValuePtr(c);
+    const malValuePtr& typeAtom() {
+        static malValuePtr c(immortal(new malConstant("ATOM")));
+        return c;
     };
-    malValuePtr typeBuiltin() {
-        static malValuePtr c(new malConstant("SUBR"));
-        return malValuePtr(c);
+    const malValuePtr& typeBuiltin() {
+        static malValuePtr c(immortal(new malConstant("SUBR")));
+        return c;
     };
-    malValuePtr typeFile() {
-        static malValuePtr c(new malConstant("FILE"));
-        return malValuePtr(c);
+    const malValuePtr& typeFile() {
+        static malValuePtr c(immortal(new malConstant("FILE")));
+        return c;
     };
-    malValuePtr typeInteger() {
-        static malValuePtr c(new malConstant("INT"));
-        return malValuePtr(c);
+    const malValuePtr& typeInteger() {
+        static malValuePtr c(immortal(new malConstant("INT")));
+        return c;
     };
-    malValuePtr typeList() {
-        static malValuePtr c(new malConstant("LIST"));
-        return malValuePtr(c);
+    const malValuePtr& typeList() {
+        static malValuePtr c(immortal(new malConstant("LIST")));
+        return c;
     };
-    malValuePtr typeMap() {
-        static malValuePtr c(new malConstant("MAP"));
-        return malValuePtr(c);
+    const malValuePtr& typeMap() {
+        static malValuePtr c(immortal(new malConstant("MAP")));
+        return c;
     };
-    malValuePtr typeReal() {
-        static malValuePtr c(new malConstant("REAL"));
-        return malValuePtr(c);
+    const malValuePtr& typeReal() {
+        static malValuePtr c(immortal(new malConstant("REAL")));
+        return c;
     };
-    malValuePtr typeString() {
-        static malValuePtr c(new malConstant("STR"));
-        return malValuePtr(c);
+    const malValuePtr& typeString() {
+        static malValuePtr c(immortal(new malConstant("STR")));
+        return c;
     };
-    malValuePtr typeSymbol() {
-        static malValuePtr c(new malConstant("SYM"));
-        return malValuePtr(c);
+    const malValuePtr& typeSymbol() {
+        static malValuePtr c(immortal(new malConstant("SYM")));
+        return c;
     };
-    malValuePtr typeUndef() {
-        static malValuePtr c(new malConstant("UNDEF"));
-        return malValuePtr(c);
+    const malValuePtr& typeUndef() {
+        static malValuePtr c(immortal(new malConstant("UNDEF")));
+        return c;
     };
-    malValuePtr typeVector() {
-        static malValuePtr c(new malConstant("VEC"));
-        return malValuePtr(c);
+    const malValuePtr& typeVector() {
+        static malValuePtr c(immortal(new malConstant("VEC")));
+        return c;
     };
-    malValuePtr typeKeword() {
-        static malValuePtr c(new malConstant("KEYW"));
-        return malValuePtr(c);
+    const malValuePtr& typeKeword() {
+        static malValuePtr c(immortal(new malConstant("KEYW")));
+        return c;
     };
 
     malValuePtr vector(malValueVec* items) {
@@ -219,13 +323,47 @@ namespace mal {
     };
 };
 
+String malAtom::print(bool readably) const
+{
+    return printValue(this, readably);
+}
+
+void malAtom::traverse(RefVisitor& visitor) const
+{
+    malValue::traverse(visitor);
+    visitor(m_value);
+}
+
+void malAtom::gcClear()
+{
+    m_value = mal::nilValue();
+    clearMeta();
+}
+
+String malCell::print(bool readably) const
+{
+    return printValue(this, readably);
+}
+
+void malCell::traverse(RefVisitor& visitor) const
+{
+    malValue::traverse(visitor);
+    visitor(m_value);
+}
+
+void malCell::gcClear()
+{
+    m_value = mal::nilValue();
+    clearMeta();
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+static String makeHashKey(const malValuePtr& key)
 {
     if (const malString* skey = DYNAMIC_CAST(malString, key)) {
         return skey->print(true);
@@ -261,14 +399,21 @@ malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
 : m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
 {
-
+    setFlag(GC_CONTAINER);
 }
 
 malHash::malHash(const malHash::Map& map)
 : m_map(map)
 , m_isEvaluated(true)
 {
+    setFlag(GC_CONTAINER);
+}
 
+malHash::malHash(malHash::Map&& map)
+: m_map(std::move(map))
+, m_isEvaluated(true)
+{
+    setFlag(GC_CONTAINER);
 }
 
 malValuePtr
@@ -281,10 +426,19 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     return mal::hash(addToMap(map, argsBegin, argsEnd));
 }
 
+// Keywords are their own key, so looking one up needn't copy it.
+static malHash::Map::const_iterator findKey(const malHash::Map& map,
+                                           const malValuePtr& key)
+{
+    if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
+        return map.find(kkey->view());
+    }
+    return map.find(makeHashKey(key));
+}
+
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return findKey(m_map, key) != m_map.end();
 }
 
 malValuePtr
@@ -298,7 +452,7 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
     return mal::hash(map);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malValuePtr malHash::eval(const malEnvPtr& env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
@@ -313,7 +467,7 @@ malValuePtr malHash::eval(malEnvPtr env)
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
+    auto it = findKey(m_map, key);
     return it == m_map.end() ? mal::nilValue() : it->second;
 }
 
@@ -344,18 +498,7 @@ malValuePtr malHash::values() const
 
 String malHash::print(bool readably) const
 {
-    String s = "{";
-
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
-    }
-
-    return s + "}";
+    return printValue(this, readably);
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
@@ -378,34 +521,52 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+void malHash::traverse(RefVisitor& visitor) const
+{
+    malValue::traverse(visitor);
+    for (auto& it : m_map) {
+        visitor(it.second);
+    }
+}
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+: m_params(new malParams(bindings))
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
 {
+    setFlag(GC_CONTAINER);
+}
 
+malLambda::malLambda(malParamsPtr params,
+                     malValuePtr body, malEnvPtr env)
+: m_params(params)
+, m_body(body)
+, m_env(env)
+, m_isMacro(false)
+{
+    setFlag(GC_CONTAINER);
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
 : malApplicable(meta)
-, m_bindings(that.m_bindings)
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
 {
-
+    setFlag(GC_CONTAINER);
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
+: malApplicable(that.hasFlag(HAS_META) ? that.meta() : malValuePtr())
+, m_params(that.m_params)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
 {
-
+    setFlag(GC_CONTAINER);
 }
 
 malValuePtr malLambda::apply(malValueIter argsBegin,
@@ -421,7 +582,19 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    return malEnvPtr(new malEnv(m_env, m_params, argsBegin, argsEnd));
+}
+
+malEnvPtr malLambda::makeEnv(malValueVec&& args) const
+{
+    return malEnvPtr(new malEnv(m_env, m_params, std::move(args)));
+}
+
+void malLambda::traverse(RefVisitor& visitor) const
+{
+    malValue::traverse(visitor);
+    visitor(m_body);
+    visitor(m_env);
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
@@ -437,7 +610,7 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::eval(const malEnvPtr& env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -453,10 +626,10 @@ malValuePtr malList::eval(malEnvPtr env)
 
 String malList::print(bool readably) const
 {
-    return '(' + malSequence::print(readably) + ')';
+    return printValue(this, readably);
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malValue::eval(const malEnvPtr& env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
@@ -482,9 +655,51 @@ bool malValue::isTrue() const
         && (this != mal::nilValue().ptr());
 }
 
+malValue::malValue(malValuePtr meta)
+{
+    TRACE_OBJECT("Creating malValue %p\n", this);
+    if (meta) {
+        metaEntry(this).meta = meta;
+        setFlag(GC_CONTAINER);
+    }
+}
+
+malValue::~malValue()
+{
+    TRACE_OBJECT("Destroying malValue %p\n", this);
+    clearMeta();
+}
+
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    if (hasFlag(HAS_META)) {
+        const malValuePtr& meta = metaTable()[this].meta;
+        if (meta) {
+            return meta;
+        }
+    }
+    return mal::nilValue();
+}
+
+void malValue::clearMeta()
+{
+    if (hasFlag(HAS_META)) {
+        // Out of the table before anything is released, as that may
+        // destroy other values with entries of their own.
+        auto it = metaTable().find(this);
+        MetaEntry entry = std::move(it->second);
+        metaTable().erase(it);
+        clearFlag(HAS_META);
+    }
+}
+
+void malValue::traverse(RefVisitor& visitor) const
+{
+    if (hasFlag(HAS_META)) {
+        const MetaEntry& entry = metaTable()[this];
+        visitor(entry.meta);
+        visitor(entry.items);
+    }
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -495,25 +710,48 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
 malSequence::malSequence(malValueVec* items)
 : m_items(items)
 {
-
+    setFlag(GC_CONTAINER);
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
 : m_items(new malValueVec(begin, end))
 {
-
+    setFlag(GC_CONTAINER);
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+, m_items(that.m_items)
 {
-
+    // Items never change once built, so the copy can use the same ones
+    // as long as their owner is kept alive.
+    malValuePtr owner = that.hasFlag(SHARES_ITEMS)
+        ? metaTable()[&that].items
+        : malValuePtr(const_cast<malSequence*>(&that));
+    metaEntry(this).items = owner;
+    setFlag(SHARES_ITEMS);
+    setFlag(GC_CONTAINER);
 }
 
 malSequence::~malSequence()
 {
-    delete m_items;
+    if (hasFlag(HAS_PARAMS)) {
+        paramsTable().erase(this);
+    }
+    if (!hasFlag(SHARES_ITEMS)) {
+        delete m_items;
+    }
+}
+
+void malSequence::traverse(RefVisitor& visitor) const
+{
+    malValue::traverse(visitor);
+    if (hasFlag(SHARES_ITEMS)) {
+        return; // counted by the owner, reached through the meta entry
+    }
+    for (auto& it : *m_items) {
+        visitor(it);
+    }
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -534,35 +772,37 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+malValueVec* malSequence::evalItems(const malEnvPtr& env, int start) const
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    malValueVec* items = new malValueVec;
+    items->reserve(count() - start);
+    for (auto it = m_items->begin() + start, end = m_items->end();
+         it != end; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
 }
 
-malValuePtr malSequence::first() const
+malParamsPtr malSequence::params() const
 {
-    return count() == 0 ? mal::nilValue() : item(0);
+    if (hasFlag(HAS_PARAMS)) {
+        return paramsTable()[this];
+    }
+
+    StringVec bindings;
+    bindings.reserve(count());
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        bindings.push_back(VALUE_CAST(malSymbol, *it)->value());
+    }
+    malParamsPtr params(new malParams(bindings));
+    paramsTable()[this] = params;
+    setFlag(HAS_PARAMS);
+    return params;
 }
 
-String malSequence::print(bool readably) const
+malValuePtr malSequence::first() const
 {
-    String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
-        str += (*it)->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
-    }
-    return str;
+    return count() == 0 ? mal::nilValue() : item(0);
 }
 
 bool malSequence::isDotted() const
@@ -588,17 +828,159 @@ malValuePtr malSequence::reverse(malValueIter argsBegin, malValueIter argsEnd) c
     return mal::list(items);
 }
 
+typedef std::unordered_map<const malStringBase*, malValueVec> RopeTable;
+
+// The pieces of ropes not flattened yet, see malStringBase::flatten().
+static RopeTable& ropeTable()
+{
+    static RopeTable* table = new RopeTable;
+    return *table;
+}
+
+// Substrings shorter than this get their own copy. Copying them costs
+// about as much as sharing, and they don't keep a large buffer alive.
+#define SHARED_SUBSTR_MIN   32
+
+malStringBuffer* malStringBuffer::create(std::string_view text)
+{
+    void* memory = ::operator new(sizeof(malStringBuffer) + text.size());
+    return new (memory) malStringBuffer(text);
+}
+
+malStringBuffer::malStringBuffer(std::string_view text)
+: m_data(m_inline)
+, m_size(text.size())
+, m_isMapped(false)
+{
+    text.copy(m_inline, m_size);
+    m_inline[m_size] = '\0';
+}
+
+malStringBuffer::malStringBuffer(const char* mapped, size_t size)
+: m_data(mapped)
+, m_size(size)
+, m_isMapped(true)
+{
+}
+
+malStringBuffer* malStringBuffer::map(const String& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_size >= MAP_MIN_SIZE) {
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    return new malStringBuffer((const char*)mapped, st.st_size);
+}
+
+malStringBuffer::~malStringBuffer()
+{
+    if (m_isMapped) {
+        munmap((void*)m_data, m_size);
+    }
+}
+
+malStringBase::malStringBase(const malStringBase& that,
+                             size_t pos, size_t length)
+: m_buffer(length < SHARED_SUBSTR_MIN
+           ? malStringBuffer::create(that.view().substr(pos, length))
+           : that.buffer().ptr())
+, m_offset(length < SHARED_SUBSTR_MIN ? 0 : that.m_offset + pos)
+, m_length(length)
+{
+}
+
+malStringBase::malStringBase(malValueVec&& pieces, size_t length)
+: m_offset(0)
+, m_length(length)
+{
+    ropeTable()[this] = std::move(pieces);
+    setFlag(IS_ROPE);
+}
+
+malStringBase::malStringBase(const malStringBase& that, malValuePtr meta)
+: malValue(meta)
+, m_buffer(that.buffer())
+, m_offset(that.m_offset)
+, m_length(that.m_length)
+{
+}
+
+malStringBase::~malStringBase()
+{
+    if (hasFlag(IS_ROPE)) {
+        // Out of the table first, see malValue::clearMeta().
+        auto it = ropeTable().find(this);
+        malValueVec pieces = std::move(it->second);
+        ropeTable().erase(it);
+    }
+}
+
+bool malStringBase::isPinning() const
+{
+    return m_length * 2 < buffer()->size();
+}
+
+void malStringBase::flatten() const
+{
+    auto it = ropeTable().find(this);
+    malValueVec pieces = std::move(it->second);
+    ropeTable().erase(it);
+
+    // Ropes are often nested as deep as the number of appends that
+    // built them, so walk them with a stack of our own.
+    String text;
+    text.reserve(m_length);
+    std::vector<const malStringBase*> pending;
+    for (auto piece = pieces.rbegin(); piece != pieces.rend(); ++piece) {
+        pending.push_back(STATIC_CAST(malStringBase, *piece));
+    }
+    while (!pending.empty()) {
+        const malStringBase* next = pending.back();
+        pending.pop_back();
+        if (next->hasFlag(IS_ROPE)) {
+            const malValueVec& inner = ropeTable()[next];
+            for (auto piece = inner.rbegin(); piece != inner.rend(); ++piece) {
+                pending.push_back(STATIC_CAST(malStringBase, *piece));
+            }
+        }
+        else {
+            text.append(next->view());
+        }
+    }
+
+    m_buffer = malStringBuffer::create(text);
+    m_offset = 0;
+    clearFlag(IS_ROPE);
+}
+
 String malString::escapedValue() const
 {
     return escape(value());
 }
 
+malValuePtr malString::substr(size_t pos, size_t length) const
+{
+    pos = std::min(pos, view().size());
+    length = std::min(length, view().size() - pos);
+    return malValuePtr(new malString(*this, pos, length));
+}
+
 String malString::print(bool readably) const
 {
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr malSymbol::eval(const malEnvPtr& env)
 {
     return env->get(value());
 }
@@ -616,14 +998,14 @@ malValuePtr malVector::conj(malValueIter argsBegin,
     return mal::vector(items);
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(const malEnvPtr& env)
 {
     return mal::vector(evalItems(env));
 }
 
 String malVector::print(bool readably) const
 {
-    return '[' + malSequence::print(readably) + ']';
+    return printValue(this, readably);
 }
 
 bool malInteger::doIsEqualTo(const malValue* rhs) const
@@ -661,22 +1043,38 @@ malValuePtr malFile::open()
     {
         return mal::nilValue();
     }
+    unbufferReads();
     return this;
 }
 
 malValuePtr malFile::close()
 {
-    MAL_CHECK(fclose(m_value) == 0,
-              "i/o can not close file");
+    MAL_CHECK(release(), "i/o can not close file");
     return mal::nilValue();
 }
 
-malValuePtr malFile::writeLine (const String &line)
+bool malFile::release()
+{
+    // Whatever was written is on its way to the file now.
+    malFileCache::invalidate(m_path);
+    m_readBuffer.reset();
+    m_readPos = m_readEnd = 0;
+    ::FILE* file = m_value;
+    m_value = NULL;
+    return file && fclose(file) == 0;
+}
+
+void malFile::writeLine(std::string_view line)
 {
-    MAL_CHECK(fprintf(m_value, "%s\n", line.c_str()) > 0,
+    MAL_CHECK(fwrite(line.data(), 1, line.size(), m_value) == line.size()
+              && fputc('\n', m_value) != EOF,
               "i/o can not write to file");
+}
 
-    return mal::string(line);
+void malFile::flush()
+{
+    malFileCache::invalidate(m_path);
+    MAL_CHECK(fflush(m_value) == 0, "i/o can not write to file");
 }
 
 malValuePtr malFile::writeChar(const char &c)
@@ -686,18 +1084,226 @@ malValuePtr malFile::writeChar(const char &c)
     return mal::integer(c);
 }
 
-malValuePtr malFile::readLine()
+void malFile::unbufferReads()
 {
-    char buf[8192];
-    if (fgets(buf, sizeof(buf), m_value))
-    {
-         return mal::string(buf);
+    // Everything is read in big blocks already, straight from the fd, so
+    // stdio mustn't read ahead of them. A socket, opened '+', also sends
+    // what is written at once, as the other side may be waiting.
+    if (m_mode == 'r' || m_mode == '+') {
+        setvbuf(m_value, NULL, _IONBF, 0);
     }
-    return mal::nilValue();
+}
+
+bool malFile::fillReadBuffer()
+{
+    if (!m_readBuffer) {
+        m_readBuffer.reset(new char[READ_BUFFER_SIZE]);
+    }
+    // One read, which on a pipe or socket returns what has arrived so far
+    // rather than waiting until the buffer is full.
+    m_readPos = m_readEnd = 0;
+    ssize_t length;
+    while ((length = read(fileno(m_value), m_readBuffer.get(),
+                          READ_BUFFER_SIZE)) < 0 && errno == EINTR) {
+    }
+    MAL_CHECK(length >= 0, "i/o can not read file");
+    m_readEnd = length;
+    return m_readEnd > 0;
+}
+
+bool malFile::nextLine(std::string_view& line)
+{
+    m_partialLine.clear();
+    while (m_readPos < m_readEnd || fillReadBuffer()) {
+        const char* start = m_readBuffer.get() + m_readPos;
+        size_t available = m_readEnd - m_readPos;
+        const char* newline = (const char*)memchr(start, '\n', available);
+        if (!newline) {
+            m_partialLine.append(start, available);
+            m_readPos = m_readEnd;
+            continue;
+        }
+        size_t length = newline - start + 1;
+        m_readPos += length;
+        line = std::string_view(start, length);
+        if (!m_partialLine.empty()) {
+            m_partialLine.append(line);
+            line = m_partialLine;
+        }
+        return true;
+    }
+    line = m_partialLine;
+    return !line.empty();
+}
+
+malValuePtr malFile::readLine(bool stripTerminator)
+{
+    std::string_view line;
+    if (!nextLine(line)) {
+        return mal::nilValue();
+    }
+    if (stripTerminator && !line.empty() && line.back() == '\n') {
+        line.remove_suffix(1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+    }
+    return mal::string(line);
+}
+
+bool malFile::skipLine()
+{
+    std::string_view line;
+    return nextLine(line);
+}
+
+size_t malFile::readBytes(char* out, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        if (m_readPos == m_readEnd) {
+            // Once the buffer is set up, big reads skip it.
+            if (m_readBuffer && size - done >= READ_BUFFER_SIZE) {
+                done += fread(out + done, 1, size - done, m_value);
+                MAL_CHECK(!ferror(m_value), "i/o can not read file");
+                break;
+            }
+            if (!fillReadBuffer()) {
+                break;
+            }
+        }
+        size_t count = std::min(size - done, m_readEnd - m_readPos);
+        memcpy(out + done, m_readBuffer.get() + m_readPos, count);
+        m_readPos += count;
+        done += count;
+    }
+    return done;
+}
+
+void malFile::writeBytes(std::string_view bytes)
+{
+    MAL_CHECK(fwrite(bytes.data(), 1, bytes.size(), m_value) == bytes.size(),
+              "i/o can not write to file");
+}
+
+int64_t malFile::position()
+{
+    // Asked of the fd, as reads go past stdio, which may have cached an
+    // offset of its own since the last seek.
+    MAL_CHECK(fflush(m_value) == 0, "i/o can not write to file");
+    off_t pos = lseek(fileno(m_value), 0, SEEK_CUR);
+    MAL_CHECK(pos >= 0, "i/o can not get file position");
+    // The file is ahead by whatever is read but not taken yet.
+    return pos - (m_readEnd - m_readPos);
+}
+
+int64_t malFile::seek(int64_t offset, int whence)
+{
+    if (whence == SEEK_CUR) {
+        offset += position();
+        whence = SEEK_SET;
+    }
+    MAL_CHECK(fseeko(m_value, offset, whence) == 0,
+              "i/o can not seek in file");
+    m_readPos = m_readEnd = 0;
+    return position();
 }
 
 malValuePtr malFile::readChar()
 {
-    return mal::integer(fgetc(m_value));
+    if (m_readPos == m_readEnd && !fillReadBuffer()) {
+        return mal::integer(EOF);
+    }
+    return mal::integer((unsigned char)m_readBuffer[m_readPos++]);
+}
+
+int64_t malStream::skip(int64_t count)
+{
+    int64_t skipped = 0;
+    while (skipped < count && next() != mal::nilValue()) {
+        skipped++;
+    }
+    return skipped;
+}
+
+malLineSeq::~malLineSeq()
+{
+    if (m_ownsFile) {
+        file()->release();
+    }
+}
+
+malValuePtr malLineSeq::next()
+{
+    if (!file()->isOpen()) {
+        return mal::nilValue();
+    }
+    malValuePtr line = file()->readLine(true);
+    if (line == mal::nilValue()) {
+        finish();
+    }
+    return line;
+}
+
+int64_t malLineSeq::skip(int64_t count)
+{
+    int64_t skipped = 0;
+    while (skipped < count && file()->isOpen()) {
+        if (!file()->skipLine()) {
+            finish();
+            break;
+        }
+        skipped++;
+    }
+    return skipped;
+}
+
+void malLineSeq::finish()
+{
+    if (m_ownsFile) {
+        file()->release();
+    }
+}
+
+malDirectorySeq::malDirectorySeq(const String& root, const String& pattern,
+                                 int kinds)
+: m_root(root)
+, m_walker(new malDirectoryWalker(root, pattern, kinds, true))
+{
+}
+
+malValuePtr malDirectorySeq::next()
+{
+    String path;
+    if (!m_walker->next(path)) {
+        return mal::nilValue();
+    }
+    return mal::string(path);
+}
+
+String malDirectorySeq::print(bool) const
+{
+    return "#<directory-seq " + escape(m_root) + ">";
+}
+
+String malBytes::print(bool) const
+{
+    // The size and the first few bytes, in hex.
+    static const char digits[] = "0123456789abcdef";
+    String out = "#<bytes " + std::to_string(m_data.size());
+    for (size_t i = 0; i < m_data.size() && i < 16; i++) {
+        out += i == 0 ? ": " : " ";
+        out += digits[m_data[i] >> 4];
+        out += digits[m_data[i] & 15];
+    }
+    if (m_data.size() > 16) {
+        out += " ...";
+    }
+    return out + ">";
+}
+
+String malLineSeq::print(bool) const
+{
+    return "#<line-seq " + m_file->print(true) + ">";
 }
 
@@ -2,11 +2,14 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "Collector.h"
 
 #include <exception>
 #include <stdio.h>
 #include <stdlib.h>
 #include <map>
+#include <memory>
+#include <string_view>
 
 class malEmptyInputException : public std::exception { };
 
@@ -17,12 +20,8 @@ public:
     malValue() {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
-        TRACE_OBJECT("Creating malValue %p\n", this);
-    }
-    virtual ~malValue() {
-        TRACE_OBJECT("Destroying malValue %p\n", this);
-    }
+    malValue(malValuePtr meta);
+    virtual ~malValue();
 
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
@@ -32,20 +31,22 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual String print(bool readably) const = 0;
 
     virtual MALTYPE type() const { return MALTYPE::UNDEF; }
 
+    virtual void traverse(RefVisitor& visitor) const;
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
-    malValuePtr m_meta;
+    void clearMeta();
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
+T* value_cast(const malValuePtr& obj, const char* typeName) {
     T* dest = dynamic_cast<T*>(obj.ptr());
     MAL_CHECK(dest != NULL, "'%s' is not a %s",
               obj->print(true).c_str(), typeName);
@@ -136,8 +137,17 @@ class malFile : public malValue {
 public:
     malFile(const char *path, const char &mode)
         : m_path(path)
+        , m_value(NULL)
+        , m_mode(mode)
+    {
+    }
+    // A stream that is open already, such as a pipe.
+    malFile(const char *path, const char &mode, ::FILE* file)
+        : m_path(path)
+        , m_value(file)
         , m_mode(mode)
     {
+        unbufferReads();
     }
     malFile(const malFile& that, malValuePtr meta)
         : malValue(meta), m_value(that.m_value) { }
@@ -156,41 +166,199 @@ public:
     }
 
     ::FILE *value() const { return m_value; }
+    bool isOpen() const { return m_value != NULL; }
+    // Whether input was read ahead and is waiting for its reader.
+    bool hasBufferedInput() const { return m_readPos < m_readEnd; }
 
     WITH_META(malFile);
 
     malValuePtr close();
+    // Closes the file if it is open, returning whether that went well.
+    bool release();
     malValuePtr open();
-    malValuePtr readLine();
+    // The next line, however long, with its terminator unless stripped.
+    // nil at the end of the file.
+    malValuePtr readLine(bool stripTerminator = false);
+    // Passes over the next line without making a string of it. false at
+    // the end of the file.
+    bool skipLine();
     malValuePtr readChar();
     malValuePtr writeChar(const char &c);
-    malValuePtr writeLine(const String &line);
+    void writeLine(std::string_view line);
+    void flush();
+
+    // Binary I/O, which picks up where the lines and chars read so far
+    // left off. readBytes returns how many bytes it read, short only at
+    // the end of the file.
+    size_t readBytes(char* out, size_t size);
+    void writeBytes(std::string_view bytes);
+    int64_t position();
+    // whence is SEEK_SET, SEEK_CUR or SEEK_END. Returns the new position.
+    int64_t seek(int64_t offset, int whence);
 
 private:
+    // Called as soon as the file is open, before stdio has used it.
+    void unbufferReads();
+    bool fillReadBuffer();
+    // The next line, only valid until the next read.
+    bool nextLine(std::string_view& line);
+
+    enum { READ_BUFFER_SIZE = 256 * 1024 };
+
     String m_path;
     ::FILE *m_value;
     char m_mode;
+
+    // Reading goes through this rather than stdio's own small buffer, so
+    // lines are found with memchr and copied once, into their string.
+    std::unique_ptr<char[]> m_readBuffer;
+    size_t m_readPos = 0;
+    size_t m_readEnd = 0;
+    String m_partialLine; // a line running past the end of the buffer
 };
 
-class malStringBase : public malValue {
+// Values made one at a time as they are asked for, so a source of any
+// size can be gone through in constant memory. A stream is read once:
+// items taken by foreach, map, count or nth are gone.
+class malStream : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
-    malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+    malStream() { }
+    malStream(malValuePtr meta) : malValue(meta) { }
 
-    virtual String print(bool readably) const { return m_value; }
+    // The next item, or nil at the end.
+    virtual malValuePtr next() = 0;
+    // Skips up to count items, returning how many there were.
+    virtual int64_t skip(int64_t count);
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+};
+
+// The lines of a file, without their terminators. A file opened by
+// read-lines is closed at its end.
+class malLineSeq : public malStream {
+public:
+    malLineSeq(malValuePtr file, bool ownsFile)
+        : m_file(file), m_ownsFile(ownsFile) { }
+    malLineSeq(const malLineSeq& that, malValuePtr meta)
+        : malStream(meta), m_file(that.m_file), m_ownsFile(false) { }
+    virtual ~malLineSeq();
+
+    virtual malValuePtr next();
+    virtual int64_t skip(int64_t count);
+
+    virtual String print(bool readably) const;
 
-    String value() const { return m_value; }
+    WITH_META(malLineSeq);
 
 private:
-    const String m_value;
+    malFile* file() const { return static_cast<malFile*>(m_file.ptr()); }
+    void finish();
+
+    malValuePtr m_file;
+    bool m_ownsFile;
+};
+
+class malDirectoryWalker;
+
+// Paths in a directory tree, as a malDirectoryWalker finds them.
+class malDirectorySeq : public malStream {
+public:
+    malDirectorySeq(const String& root, const String& pattern, int kinds);
+    malDirectorySeq(const malDirectorySeq& that, malValuePtr meta)
+        : malStream(meta), m_root(that.m_root), m_walker(that.m_walker) { }
+
+    virtual malValuePtr next();
+
+    virtual String print(bool readably) const;
+
+    WITH_META(malDirectorySeq);
+
+private:
+    String m_root;
+    std::shared_ptr<malDirectoryWalker> m_walker;
+};
+
+// Immutable bytes shared by a string and any substrings taken from it.
+// The text is allocated inline, after the header, or is a read-only
+// mapping of a file, unmapped with the buffer.
+class malStringBuffer : public RefCounted {
+public:
+    static malStringBuffer* create(std::string_view text);
+    // NULL for what can't or needn't be mapped: pipes, special files and
+    // anything smaller than MAP_MIN_SIZE, which is cheaper to copy. The
+    // file must not be truncated while the buffer is alive.
+    static malStringBuffer* map(const String& path);
+    ~malStringBuffer();
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    static void operator delete(void* p) { ::operator delete(p); }
+
+    enum { MAP_MIN_SIZE = 64 * 1024 };
+
+private:
+    malStringBuffer(std::string_view text);
+    malStringBuffer(const char* mapped, size_t size);
+
+    const char* const m_data;
+    const size_t m_size;
+    const bool m_isMapped;
+    char m_inline[1];
+};
+
+typedef RefCountedPtr<const malStringBuffer> malStringBufferPtr;
+
+class malStringBase : public malValue {
+public:
+    malStringBase(std::string_view token)
+        : m_buffer(malStringBuffer::create(token))
+        , m_offset(0), m_length(token.size()) { }
+    malStringBase(const malStringBuffer* buffer)
+        : m_buffer(buffer), m_offset(0), m_length(buffer->size()) { }
+    malStringBase(const malStringBase& that, size_t pos, size_t length);
+    // A rope: the text of the pieces, which are strings, joined. Nothing
+    // is copied until view() first needs the text.
+    malStringBase(malValueVec&& pieces, size_t length);
+    malStringBase(const malStringBase& that, malValuePtr meta);
+    virtual ~malStringBase();
+
+    virtual String print(bool readably) const { return value(); }
+
+    // Copies the text, use view() where a String isn't needed.
+    String value() const { return String(view()); }
+    std::string_view view() const {
+        if (hasFlag(IS_ROPE)) {
+            flatten();
+        }
+        return std::string_view(m_buffer->data() + m_offset, m_length);
+    }
+    size_t length() const { return m_length; }
+
+    // True if this is a small part of a buffer it keeps alive.
+    bool isPinning() const;
+
+private:
+    const malStringBufferPtr& buffer() const { view(); return m_buffer; }
+    void flatten() const;
+
+    mutable malStringBufferPtr m_buffer;
+    mutable size_t m_offset;
+    const size_t m_length;
 };
 
 class malString : public malStringBase {
 public:
-    malString(const String& token)
+    malString(std::string_view token)
         : malStringBase(token) { }
+    malString(const malStringBuffer* buffer)
+        : malStringBase(buffer) { }
+    malString(const malString& that, size_t pos, size_t length)
+        : malStringBase(that, pos, length) { }
+    malString(malValueVec&& pieces, size_t length)
+        : malStringBase(std::move(pieces), length) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
@@ -199,22 +367,79 @@ public:
 
     String escapedValue() const;
 
+    // The part [pos, pos + length) of this string.
+    malValuePtr substr(size_t pos, size_t length) const;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malString*>(rhs)->value();
+        return view() == static_cast<const malString*>(rhs)->view();
     }
 
     WITH_META(malString);
 };
 
+// Mutable text, for building up a string a piece at a time without
+// copying what is already there, see string-builder.
+class malStringBuilder : public malValue {
+public:
+    malStringBuilder() { }
+    malStringBuilder(const malStringBuilder& that, malValuePtr meta)
+        : malValue(meta), m_text(that.m_text) { }
+
+    virtual String print(bool readably) const {
+        return readably ? "(string-builder " + escape(m_text) + ")"
+                        : m_text;
+    }
+
+    String& text() { return m_text; }
+    std::string_view view() const { return m_text; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malStringBuilder);
+
+private:
+    String m_text;
+};
+
+// Raw bytes, for binary files, kept in one block so they are read,
+// written and picked apart without a value per byte. Unlike a string it
+// can be changed in place. Equal to bytes with the same contents.
+class malBytes : public malValue {
+public:
+    malBytes(size_t size) : m_data(size) { }
+    malBytes(std::string_view bytes) : m_data(bytes.begin(), bytes.end()) { }
+    malBytes(const malBytes& that, malValuePtr meta)
+        : malValue(meta), m_data(that.m_data) { }
+
+    virtual String print(bool readably) const;
+
+    std::vector<uint8_t>& data() { return m_data; }
+    size_t size() const { return m_data.size(); }
+    std::string_view view() const {
+        return std::string_view((const char*)m_data.data(), m_data.size());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_data == static_cast<const malBytes*>(rhs)->m_data;
+    }
+
+    WITH_META(malBytes);
+
+private:
+    std::vector<uint8_t> m_data;
+};
+
 class malKeyword : public malStringBase {
 public:
-    malKeyword(const String& token)
+    malKeyword(std::string_view token)
         : malStringBase(token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malKeyword*>(rhs)->value();
+        return view() == static_cast<const malKeyword*>(rhs)->view();
     }
 
     virtual MALTYPE type() const { return MALTYPE::KEYW; }
@@ -222,14 +447,20 @@ public:
     WITH_META(malKeyword);
 };
 
-class malSymbol : public malStringBase {
+// Symbols are looked up far more often than they are made, so they keep
+// their own String and hand out references to it.
+class malSymbol : public malValue {
 public:
     malSymbol(const String& token)
-        : malStringBase(token) { }
+        : m_value(token) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malValue(meta), m_value(that.m_value) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
+
+    virtual String print(bool readably) const { return m_value; }
+
+    const String& value() const { return m_value; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
@@ -238,6 +469,9 @@ public:
     virtual MALTYPE type() const { return MALTYPE::SYM; }
 
     WITH_META(malSymbol);
+
+private:
+    const String m_value;
 };
 
 class malSequence : public malValue {
@@ -247,13 +481,11 @@ public:
     malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
-    virtual String print(bool readably) const;
-
-    malValueVec* evalItems(malEnvPtr env) const;
+    malValueVec* evalItems(const malEnvPtr& env, int start = 0) const;
     int count() const { return m_items->size(); }
     bool isEmpty() const { return m_items->empty(); }
     bool isDotted() const;
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    const malValuePtr& item(int index) const { return (*m_items)[index]; }
 
     malValueIter begin() const { return m_items->begin(); }
     malValueIter end()   const { return m_items->end(); }
@@ -268,7 +500,15 @@ public:
     virtual malValuePtr rest() const;
     virtual malValuePtr dotted() const;
 
+    // This sequence compiled as a parameter list, cached on the node so
+    // every closure and frame created from it shares one descriptor.
+    malParamsPtr params() const;
+
+    virtual void traverse(RefVisitor& visitor) const;
+
 private:
+    // Shared with the sequence this was copied from by with-meta, if
+    // flagged SHARES_ITEMS.
     malValueVec* const m_items;
 };
 
@@ -282,7 +522,7 @@ public:
 
     virtual String print(bool readably) const;
     virtual MALTYPE type() const { return MALTYPE::LIST; }
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
@@ -298,7 +538,7 @@ public:
     malVector(const malVector& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(const malEnvPtr& env);
     virtual String print(bool readably) const;
     virtual MALTYPE type() const { return MALTYPE::VEC; }
 
@@ -319,20 +559,24 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    typedef std::map<String, malValuePtr, std::less<>> Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
+    malHash(malHash::Map&& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) {
+        setFlag(GC_CONTAINER);
+    }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
     bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
+    malValuePtr eval(const malEnvPtr& env);
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
+    const Map& map() const { return m_map; }
 
     virtual String print(bool readably) const;
 
@@ -340,6 +584,8 @@ public:
 
     virtual MALTYPE type() const { return MALTYPE::MAP; }
 
+    virtual void traverse(RefVisitor& visitor) const;
+
     WITH_META(malHash);
 
 private:
@@ -388,6 +634,7 @@ private:
 class malLambda : public malApplicable {
 public:
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(malParamsPtr params, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
@@ -396,6 +643,7 @@ public:
 
     malValuePtr getBody() const { return m_body; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
+    malEnvPtr makeEnv(malValueVec&& args) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
@@ -409,26 +657,28 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    // The parameters aren't reported. They only refer back to the body,
+    // which is kept alive by the fn* form anyway.
+    virtual void traverse(RefVisitor& visitor) const;
+
 private:
-    const StringVec   m_bindings;
+    const malParamsPtr m_params;
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
 };
 
-class malAtom : public malValue {
+class malAtom : public malValue, public malGcTracked {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : m_value(value) { setFlag(GC_CONTAINER); }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(meta), m_value(that.m_value) { setFlag(GC_CONTAINER); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
     }
 
-    virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
-    };
+    virtual String print(bool readably) const;
 
     virtual MALTYPE type() const { return MALTYPE::ATOM; }
 
@@ -436,26 +686,72 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void traverse(RefVisitor& visitor) const;
+    virtual void gcClear();
+    virtual const RefCounted* gcObject() const { return this; }
+
     WITH_META(malAtom);
 
 private:
     malValuePtr m_value;
 };
 
+// A binding shared by the frame that defines it and the closures that
+// captured it, so that setq on either side is seen by both. Cells only
+// live in env slots; malEnv reads and writes through them.
+class malCell : public malValue, public malGcTracked {
+public:
+    malCell(malValuePtr value) : m_value(value) {
+        setFlag(IS_CELL);
+        setFlag(GC_CONTAINER);
+    }
+    malCell(const malCell& that, malValuePtr meta)
+        : malValue(meta), m_value(that.m_value) {
+        setFlag(IS_CELL);
+        setFlag(GC_CONTAINER);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const;
+
+    malValuePtr value() const { return m_value; }
+    void setValue(malValuePtr value) { m_value = value; }
+
+    virtual void traverse(RefVisitor& visitor) const;
+    virtual void gcClear();
+    virtual const RefCounted* gcObject() const { return this; }
+
+    WITH_META(malCell);
+
+private:
+    malValuePtr m_value;
+};
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
-    malValuePtr boolean(bool value);
+    const malValuePtr& boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
     malValuePtr builtin(bool eval, const String&);
-    malValuePtr falseValue();
+    malValuePtr bytes(size_t size);
+    malValuePtr bytes(std::string_view bytes);
+    malValuePtr cell(malValuePtr value);
+    malValuePtr directorySeq(const String& root, const String& pattern,
+                             int kinds);
+    const malValuePtr& falseValue();
     malValuePtr file(const char *path, const char &mode);
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
+    malValuePtr hash(malHash::Map&& map);
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
-    malValuePtr keyword(const String& token);
+    malValuePtr keyword(std::string_view token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(malParamsPtr, malValuePtr, malEnvPtr);
+    malValuePtr lineSeq(malValuePtr file, bool ownsFile);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
@@ -464,25 +760,28 @@ namespace mal {
     malValuePtr macro(const malLambda& lambda);
     malValuePtr mdouble(double value);
     malValuePtr mdouble(const String& token);
-    malValuePtr nilValue();
-    malValuePtr nullValue();
-    malValuePtr string(const String& token);
+    const malValuePtr& nilValue();
+    const malValuePtr& nullValue();
+    malValuePtr rope(malValueVec&& pieces, size_t length);
+    malValuePtr string(std::string_view token);
+    malValuePtr string(const malStringBuffer* buffer);
+    malValuePtr stringBuilder();
     malValuePtr symbol(const String& token);
-    malValuePtr trueValue();
+    const malValuePtr& trueValue();
     malValuePtr type(MALTYPE type);
-    malValuePtr typeAtom();
-    malValuePtr typeBuiltin();
-    malValuePtr typeFile();
-    malValuePtr typeInteger();
-    malValuePtr typeList();
-    malValuePtr typeMap();
-    malValuePtr typeReal();
-    malValuePtr typeString();
-    malValuePtr typeSymbol();
-    malValuePtr typeUndef();
-    malValuePtr typeVector();
-    malValuePtr typeKeword();
-    malValuePtr piValue();
+    const malValuePtr& typeAtom();
+    const malValuePtr& typeBuiltin();
+    const malValuePtr& typeFile();
+    const malValuePtr& typeInteger();
+    const malValuePtr& typeList();
+    const malValuePtr& typeMap();
+    const malValuePtr& typeReal();
+    const malValuePtr& typeString();
+    const malValuePtr& typeSymbol();
+    const malValuePtr& typeUndef();
+    const malValuePtr& typeVector();
+    const malValuePtr& typeKeword();
+    const malValuePtr& piValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
 };
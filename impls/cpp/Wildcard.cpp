@@ -0,0 +1,222 @@
+#include "Wildcard.h"
+
+#include <ctype.h>
+#include <list>
+#include <unordered_map>
+
+// The code point at pos, moving pos past it. A byte that doesn't start a
+// valid UTF-8 sequence stands for itself.
+static char32_t nextChar(std::string_view text, size_t& pos)
+{
+    unsigned char lead = text[pos];
+    size_t length = lead < 0x80 ? 1
+                  : (lead >> 5) == 0x06 ? 2
+                  : (lead >> 4) == 0x0e ? 3
+                  : (lead >> 3) == 0x1e ? 4
+                  : 1;
+    if (pos + length > text.size()) {
+        length = 1;
+    }
+    char32_t c = length == 1 ? lead : lead & (0x7f >> length);
+    for (size_t i = 1; i < length; i++) {
+        unsigned char next = text[pos + i];
+        if ((next & 0xc0) != 0x80) {
+            pos++;
+            return lead;
+        }
+        c = c << 6 | (next & 0x3f);
+    }
+    pos += length;
+    return c;
+}
+
+static bool isDigit(char32_t c)
+{
+    return c < 0x80 && isdigit(c);
+}
+
+static bool isLetter(char32_t c)
+{
+    return c >= 0x80 || isalpha(c);
+}
+
+malWildcard::malWildcard(std::string_view pattern)
+{
+    m_alternatives.push_back({ false, 0, 0 });
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+        Alternative& alternative = m_alternatives.back();
+        char32_t c = nextChar(pattern, pos);
+        Token token = { Token::LITERAL, c, false, 0, 0 };
+        switch (c) {
+            case ',':
+                m_alternatives.push_back({ false, m_tokens.size(), 0 });
+                continue;
+            case '~':
+                if (alternative.tokenCount == 0 && !alternative.isNegated) {
+                    alternative.isNegated = true;
+                    continue;
+                }
+                break;
+            case '#': token.kind = Token::DIGIT;  break;
+            case '@': token.kind = Token::LETTER; break;
+            case '.': token.kind = Token::OTHER;  break;
+            case '?': token.kind = Token::ANY;    break;
+            case '*': token.kind = Token::STAR;   break;
+            case '`':
+                if (pos < pattern.size()) {
+                    token.c = nextChar(pattern, pos);
+                }
+                break;
+            case '[': {
+                // A [ that isn't closed is just a [.
+                size_t end = pos;
+                token.isNegated = end < pattern.size() && pattern[end] == '~';
+                if (token.isNegated) {
+                    end++;
+                }
+                token.firstRange = m_ranges.size();
+                bool isClosed = false;
+                while (end < pattern.size()) {
+                    char32_t first = nextChar(pattern, end);
+                    if (first == ']') {
+                        isClosed = true;
+                        break;
+                    }
+                    if (first == '`' && end < pattern.size()) {
+                        first = nextChar(pattern, end);
+                    }
+                    char32_t last = first;
+                    if (end + 1 < pattern.size() && pattern[end] == '-'
+                        && pattern[end + 1] != ']') {
+                        end++;
+                        last = nextChar(pattern, end);
+                        if (last == '`' && end < pattern.size()) {
+                            last = nextChar(pattern, end);
+                        }
+                    }
+                    m_ranges.push_back({ first, last });
+                }
+                if (isClosed) {
+                    token.kind = Token::SET;
+                    token.rangeCount = m_ranges.size() - token.firstRange;
+                    pos = end;
+                }
+                else {
+                    m_ranges.resize(token.firstRange);
+                    token.isNegated = false;
+                }
+                break;
+            }
+        }
+        m_tokens.push_back(token);
+        alternative.tokenCount++;
+    }
+}
+
+bool malWildcard::matches(std::string_view text) const
+{
+    for (const auto& alternative : m_alternatives) {
+        if (matches(alternative, text)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool malWildcard::matches(const Alternative& alternative,
+                          std::string_view text) const
+{
+    // On a mismatch, let the last * take one more character and retry.
+    const Token* tokens = m_tokens.data() + alternative.firstToken;
+    size_t count = alternative.tokenCount;
+    size_t t = 0;
+    size_t pos = 0;
+    size_t starToken = count;
+    size_t starPos = 0;
+    bool isMatch = true;
+    while (pos < text.size()) {
+        if (t < count && tokens[t].kind == Token::STAR) {
+            starToken = t++;
+            starPos = pos;
+            continue;
+        }
+        size_t next = pos;
+        if (t < count && matches(tokens[t], nextChar(text, next))) {
+            t++;
+            pos = next;
+            continue;
+        }
+        if (starToken == count) {
+            isMatch = false;
+            break;
+        }
+        t = starToken + 1;
+        nextChar(text, starPos);
+        pos = starPos;
+    }
+    while (isMatch && t < count && tokens[t].kind == Token::STAR) {
+        t++;
+    }
+    isMatch = isMatch && t == count;
+    return isMatch != alternative.isNegated;
+}
+
+bool malWildcard::matches(const Token& token, char32_t c) const
+{
+    switch (token.kind) {
+        case Token::LITERAL: return c == token.c;
+        case Token::DIGIT:   return isDigit(c);
+        case Token::LETTER:  return isLetter(c);
+        case Token::OTHER:   return !isDigit(c) && !isLetter(c);
+        case Token::ANY:     return true;
+        case Token::STAR:    return false;
+        case Token::SET:     break;
+    }
+    bool isInSet = false;
+    for (size_t i = 0; i < token.rangeCount && !isInSet; i++) {
+        const auto& range = m_ranges[token.firstRange + i];
+        isInSet = c >= range.first && c <= range.second;
+    }
+    return isInSet != token.isNegated;
+}
+
+namespace {
+
+struct CacheEntry {
+    CacheEntry(std::string_view pattern)
+        : pattern(pattern), wildcard(pattern) { }
+
+    String pattern;
+    malWildcard wildcard;
+};
+
+// Most recently used first. The index is keyed by views of the patterns
+// held in the list, so looking one up doesn't need a string made for it.
+struct Cache {
+    std::list<CacheEntry> entries;
+    std::unordered_map<std::string_view,
+                       std::list<CacheEntry>::iterator> index;
+};
+
+}
+
+const malWildcard& malWildcard::compiled(std::string_view pattern)
+{
+    // Leaked, so exiting doesn't spend time freeing every cached pattern.
+    static Cache* cache = new Cache;
+    auto found = cache->index.find(pattern);
+    if (found != cache->index.end()) {
+        cache->entries.splice(cache->entries.begin(), cache->entries,
+                              found->second);
+        return found->second->wildcard;
+    }
+    if (cache->entries.size() >= CACHE_SIZE) {
+        cache->index.erase(cache->entries.back().pattern);
+        cache->entries.pop_back();
+    }
+    cache->entries.emplace_front(pattern);
+    cache->index.emplace(cache->entries.front().pattern,
+                         cache->entries.begin());
+    return cache->entries.front().wildcard;
+}
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_WILDCARD_H
+#define INCLUDE_WILDCARD_H
+
+#include "MAL.h"
+
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// An AutoLISP wcmatch pattern, compiled once into tokens that are then
+// matched by backtracking over the text, one character at a time:
+//
+//   #  a digit          @  a letter          .  anything but a letter
+//   *  any run          ?  any character        or a digit
+//   [abc] [a-z]  one of these  [~abc]  anything but one of these
+//   `x  x itself        ,  separates alternatives
+//   ~  first in an alternative, anything the rest doesn't match
+//
+// Characters are UTF-8 code points, anything beyond ASCII counts as a
+// letter. Matching allocates nothing.
+class malWildcard {
+public:
+    malWildcard(std::string_view pattern);
+
+    bool matches(std::string_view text) const;
+
+    // The compiled pattern, from a cache of the most recently used ones.
+    // Valid until the next call.
+    static const malWildcard& compiled(std::string_view pattern);
+
+    enum { CACHE_SIZE = 256 };
+
+private:
+    struct Token {
+        enum Kind { LITERAL, DIGIT, LETTER, OTHER, ANY, STAR, SET };
+        Kind kind;
+        char32_t c;             // LITERAL
+        bool isNegated;         // SET
+        size_t firstRange;      // SET: its ranges in m_ranges
+        size_t rangeCount;
+    };
+
+    struct Alternative {
+        bool isNegated;
+        size_t firstToken;      // in m_tokens
+        size_t tokenCount;
+    };
+
+    bool matches(const Alternative& alternative, std::string_view text) const;
+    bool matches(const Token& token, char32_t c) const;
+
+    std::vector<Alternative> m_alternatives;
+    std::vector<Token> m_tokens;
+    std::vector<std::pair<char32_t, char32_t>> m_ranges;
+};
+
+#endif // INCLUDE_WILDCARD_H
@@ -60,7 +60,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr)
     return ast;
 }
 
-malValuePtr APPLY(malValuePtr ast, malValueIter, malValueIter)
+malValuePtr APPLY(const malValuePtr& ast, malValueIter, malValueIter)
 {
     return ast;
 }
@@ -1,6 +1,7 @@
 #include "MAL.h"
 
 #include "Environment.h"
+#include "Printer.h"
 #include "ReadLine.h"
 #include "Types.h"
 
@@ -57,7 +58,11 @@ static void installEvalCore(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
+static void printRep(const String& input, malEnvPtr env);
+static void printTrace(const malValuePtr& ast);
 static malValuePtr quasiquote(malValuePtr obj);
+static malValuePtr makeClosure(const malSequence* bindings, malValuePtr body,
+                               malEnvPtr env);
 
 static ReadLine s_readLine("~/.mal-history");
 
@@ -79,10 +84,11 @@ int main(int argc, char* argv[])
         return 0;
     }
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
+    // Output is only forced out here, before waiting for the next line.
+    malOutputPort::console().flush();
     while (s_readLine.get(prompt, input)) {
-        String out = safeRep(input, replEnv);
-        if (out.length() > 0)
-            std::cout << out << "\n";
+        printRep(input, replEnv);
+        malOutputPort::console().flush();
     }
     return 0;
 }
@@ -103,6 +109,38 @@ static String safeRep(const String& input, malEnvPtr env)
     };
 }
 
+// Like safeRep, but streams the result to stdout rather than building a
+// string of it first, respecting *print-length* and *print-level*.
+static void printRep(const String& input, malEnvPtr env)
+{
+    malPrinter out(malOutputPort::console());
+    try {
+        malValuePtr result = EVAL(READ(input), env);
+        out.limitBy(env);
+        out.print(result, true);
+    }
+    catch (malEmptyInputException&) {
+        return;
+    }
+    catch (malValuePtr& mv) {
+        out.write("Error: ");
+        out.print(mv, true);
+    }
+    catch (String& s) {
+        out.write("Error: ");
+        out.write(s);
+    }
+    out.write('\n');
+}
+
+static void printTrace(const malValuePtr& ast)
+{
+    malPrinter out(malOutputPort::console());
+    out.write("TRACE: ");
+    out.print(ast, true);
+    out.write('\n');
+}
+
 static void makeArgv(malEnvPtr env, int argc, char* argv[])
 {
     malValueVec* args = new malValueVec();
@@ -128,15 +166,25 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
     while (1) {
-
+        // Everything in use is held by a counted pointer here, so this is
+        // a safe point to free what was left over and look for cycles.
+        if (RefCounted::pending() > 0) {
+            RefCounted::drain(RefCounted::reclaimBudget());
+        }
+        if (malCollector::isDue()) {
+            malCollector::collect();
+        }
 
         const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
         if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
-            std::cout << "EVAL: " << PRINT(ast) << "\n";
+            malPrinter out(malOutputPort::console());
+            out.write("EVAL: ");
+            out.print(ast, true);
+            out.write('\n');
         }
 
         if (traceDebug) {
-            std::cout << "TRACE: " << PRINT(ast) << std::endl;
+            printTrace(ast);
         }
 
         const malList* list = DYNAMIC_CAST(malList, ast);
@@ -147,27 +195,24 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
+            const String& special = symbol->value();
 
             const malEnvPtr traceEnv = shadowEnv->find(strToUpper(special));
             if (traceEnv && traceEnv->get(strToUpper(special))->print(true) != "nil") {
                 traceDebug = true;
-                std::cout << "TRACE: " << PRINT(ast) << std::endl;
+                printTrace(ast);
             }
             int argCount = list->count() - 1;
 
             if (special == "and") {
                 checkArgsAtLeast("and", 2, argCount);
-                int value = 0;
-                for (int i = 1; i < argCount+1; i++) {
-                    if (EVAL(list->item(i), env)->isTrue()) {
-                        value |= 1;
-                    }
-                    else {
-                        value |= 2;
+                // Stop at the first false operand, the rest are never run.
+                for (int i = 1; i <= argCount; i++) {
+                    if (!EVAL(list->item(i), env)->isTrue()) {
+                        return mal::falseValue();
                     }
                 }
-                return value == 3 ? mal::falseValue() : mal::trueValue();
+                return mal::trueValue();
             }
 
             if (special == "bound?" || special == "boundp") {
@@ -190,6 +235,20 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 return mal::trueValue();
             }
 
+            if (special == "cond") {
+                // Flat walk over the (test expr) pairs, no re-expansion.
+                malValuePtr branch = mal::nilValue();
+                for (int i = 1; i <= argCount; i += 2) {
+                    if (EVAL(list->item(i), env)->isTrue()) {
+                        MAL_CHECK(i < argCount, "odd number of forms to cond");
+                        branch = list->item(i + 1);
+                        break;
+                    }
+                }
+                ast = std::move(branch);
+                continue; // TCO
+            }
+
             if (special == "debug-eval") {
                 checkArgsIs("debug-eval", 1, argCount);
                 if (list->item(1) == mal::trueValue()) {
@@ -220,25 +279,22 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "defun") {
                 checkArgsAtLeast("defun", 3, argCount);
 
-                String macro = "(do";
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(2));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
 
-                for (int i = 3; i <= argCount; i++) {
-                    macro += " ";
-                    macro += list->item(i)->print(true);
-                }
-                macro += ")";
-                malValuePtr body = READ(macro);
-                const malLambda* lambda = new malLambda(params, body, env);
-                return env->set(id->value(), new malLambda(*lambda, true));
+                // Several body forms share one (do ...) built from the
+                // original nodes, nothing is printed or read back.
+                malValuePtr body = list->item(3);
+                if (argCount > 3) {
+                    malValueVec* items = new malValueVec;
+                    items->reserve(argCount - 1);
+                    items->push_back(mal::symbol("do"));
+                    items->insert(items->end(), list->begin() + 3, list->end());
+                    body = mal::list(items);
+                }
+                return env->set(id->value(),
+                                makeClosure(bindings, body, env));
             }
 
             if (special == "do" || special == "progn") {
@@ -256,41 +312,53 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
 
-                return mal::lambda(params, list->item(2), env);
+                return makeClosure(bindings, list->item(2), env);
             }
 
             if (special == "foreach") {
-                checkArgsIs("foreach", 3, argCount);
-                const malSymbol* sym =
-                        VALUE_CAST(malSymbol, list->item(1));
-                malSequence* each =
-                    VALUE_CAST(malSequence, EVAL(list->item(2), env));
+                checkArgsAtLeast("foreach", 3, argCount);
+                const malSymbol* sym = VALUE_CAST(malSymbol, list->item(1));
+                malValuePtr seq = EVAL(list->item(2), env);
+                if (seq == mal::nilValue()) {
+                    return mal::nilValue();
+                }
+                malStream* stream = DYNAMIC_CAST(malStream, seq);
+                const malSequence* each =
+                    stream ? NULL : VALUE_CAST(malSequence, seq);
 
+                // The loop variable is the only binding of the inner frame,
+                // so anything else the body sets reaches the enclosing scope.
                 malEnvPtr inner(new malEnv(env));
-                inner->set(sym->value(), mal::nilValue());
-                int count = each->count();
-                malValuePtr result = NULL;
-                for (int i=0; i < count; i++) {
-                    inner->set(sym->value(), each->item(i));
-                    result = EVAL(list->item(3), inner);
-                }
-                if (result) {
+                inner->setLamdaMode(true);
+                malValuePtr& slot = inner->bind(sym->value());
+
+                malValueIter bodyBegin = list->begin() + 3;
+                malValueIter bodyEnd = list->end();
+                malValuePtr result = mal::nilValue();
+                auto runBody = [&](const malValuePtr& item) {
+                    malEnv::assign(slot, item);
+                    for (auto body = bodyBegin; body != bodyEnd; ++body) {
+                        result = EVAL(*body, inner);
+                    }
+                };
+                if (stream) {
+                    for (malValuePtr item; (item = stream->next()) != mal::nilValue(); ) {
+                        runBody(item);
+                    }
                     return result;
                 }
-                return mal::nilValue();
+                for (auto it = each->begin(), end = each->end(); it != end; ++it) {
+                    runBody(*it);
+                }
+                return result;
             }
 
             if (special == "getkword") {
                 checkArgsIs("getkword", 1, argCount);
                 const malString* msg = VALUE_CAST(malString, list->item(1));
-                std::cout << msg->value();
+                malOutputPort::console().write(msg->view());
+                malOutputPort::console().flush();
 
                 const malString* pat = VALUE_CAST(malString, shadowEnv->get("INITGET-STR"));
                 const malInteger* bit = VALUE_CAST(malInteger, shadowEnv->get("INITGET-BIT"));
@@ -316,7 +384,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                     if ((bit->value() & 1) != 1) {
                         return mal::nilValue();
                     }
-                    std::cout << msg->value();
+                    malOutputPort::console().write(msg->view());
+                    malOutputPort::console().flush();
                 }
             }
 
@@ -364,33 +433,24 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                     inner->set(var->value(), EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
-                env = inner;
+                env = std::move(inner);
                 continue; // TCO
             }
 
             if (special == "minus?" || special == "minusp" ) {
                 checkArgsIs(special.c_str(), 1, argCount);
-                if (EVAL(list->item(1), env)->type() == MALTYPE::REAL) {
-                    malDouble* val = VALUE_CAST(malDouble, EVAL(list->item(1), env));
-                    if (special == "minus?") {
-                        return mal::boolean(val->value() < 0.0);
-                    }
-                    else {
-                        return val->value() < 0 ? mal::trueValue() : mal::nilValue();
-                    }
+                malValuePtr arg = EVAL(list->item(1), env);
+                bool isMinus = false;
+                if (arg->type() == MALTYPE::REAL) {
+                    isMinus = STATIC_CAST(malDouble, arg)->value() < 0.0;
                 }
-                else if (EVAL(list->item(1), env)->type() == MALTYPE::INT) {
-                    malInteger* val = VALUE_CAST(malInteger, EVAL(list->item(1), env));
-                    if (special == "minus?") {
-                        return mal::boolean(val->value() < 0);
-                    }
-                    else {
-                        return val->value() < 0 ? mal::trueValue() : mal::nilValue();
-                    }
+                else if (arg->type() == MALTYPE::INT) {
+                    isMinus = STATIC_CAST(malInteger, arg)->value() < 0;
                 }
-                else {
-                        return special == "minus?" ? mal::falseValue() : mal::nilValue();
+                if (special == "minus?") {
+                    return mal::boolean(isMinus);
                 }
+                return isMinus ? mal::trueValue() : mal::nilValue();
             }
 #if 0
             if (special == "number?" || special == "numberp") {
@@ -408,16 +468,13 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 #endif
             if (special == "or") {
                 checkArgsAtLeast("or", 2, argCount);
-                int value = 0;
-                for (int i = 1; i < argCount+1; i++) {
+                // Stop at the first true operand, the rest are never run.
+                for (int i = 1; i <= argCount; i++) {
                     if (EVAL(list->item(i), env)->isTrue()) {
-                        value |= 1;
-                    }
-                    else {
-                        value |= 2;
+                        return mal::trueValue();
                     }
                 }
-                return value == 3 ? mal::trueValue() : mal::falseValue();
+                return mal::falseValue();
             }
 
             if (special == "quasiquote") {
@@ -432,13 +489,18 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             }
 
             if (special == "repeat") {
-                checkArgsIs("repeat*", 2, argCount);
-                const malInteger* loop = VALUE_CAST(malInteger, list->item(1));
-                for (int i = 1; i < loop->value(); i++) {
-                    EVAL(list->item(argCount), env);
+                checkArgsAtLeast("repeat", 2, argCount);
+                const malValuePtr times = EVAL(list->item(1), env);
+                const int64_t count = VALUE_CAST(malInteger, times)->value();
+                malValueIter bodyBegin = list->begin() + 2;
+                malValueIter bodyEnd = list->end();
+                malValuePtr result = mal::nilValue();
+                for (int64_t i = 0; i < count; i++) {
+                    for (auto body = bodyBegin; body != bodyEnd; ++body) {
+                        result = EVAL(*body, env);
+                    }
                 }
-                ast = list->item(argCount);
-                continue; // TCO
+                return result;
             }
 
             if (special == "set") {
@@ -482,7 +544,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
-                    ast = tryBody;
+                    ast = std::move(tryBody);
                     continue; // TCO
                 }
                 checkArgsIs("try*", 2, argCount);
@@ -525,45 +587,34 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             }
 
             if (special == "while") {
-                checkArgsIs("while", 2, argCount);
-
-                malValuePtr loop = list->item(1);
-                malValuePtr loopBody = list->item(argCount);
-
-                while (1) {
-                    loopBody = EVAL(list->item(argCount), env);
-                    loop = EVAL(list->item(1), env);
-
-                    if (!loop->isTrue()) {
-                        ast = loopBody;
-                        break;
+                checkArgsAtLeast("while", 1, argCount);
+
+                const malValuePtr& test = *(list->begin() + 1);
+                malValueIter bodyBegin = list->begin() + 2;
+                malValueIter bodyEnd = list->end();
+                malValuePtr result = mal::nilValue();
+                while (EVAL(test, env)->isTrue()) {
+                    for (auto body = bodyBegin; body != bodyEnd; ++body) {
+                        result = EVAL(*body, env);
                     }
                 }
-                continue; // TCO
+                return result;
             }
+
             if (special == "zero?" || special == "zerop") {
-                                checkArgsIs(special.c_str(), 1, argCount);
-                if (EVAL(list->item(1), env)->type() == MALTYPE::REAL) {
-                    malDouble* val = VALUE_CAST(malDouble, EVAL(list->item(1), env));
-                    if (special == "zero?") {
-                        return mal::boolean(val->value() == 0.0);
-                    }
-                    else {
-                        return val->value() == 0 ? mal::trueValue() : mal::nilValue();
-                    }
+                checkArgsIs(special.c_str(), 1, argCount);
+                malValuePtr arg = EVAL(list->item(1), env);
+                bool isZero = false;
+                if (arg->type() == MALTYPE::REAL) {
+                    isZero = STATIC_CAST(malDouble, arg)->value() == 0.0;
                 }
-                else if (EVAL(list->item(1), env)->type() == MALTYPE::INT) {
-                    malInteger* val = VALUE_CAST(malInteger, EVAL(list->item(1), env));
-                    if (special == "zero?") {
-                        return mal::boolean(val->value() == 0);
-                    }
-                    else {
-                        return val->value() == 0 ? mal::trueValue() : mal::nilValue();
-                    }
+                else if (arg->type() == MALTYPE::INT) {
+                    isZero = STATIC_CAST(malInteger, arg)->value() == 0;
                 }
-                else {
-                        return special == "zero?" ? mal::falseValue() : mal::nilValue();
+                if (special == "zero?") {
+                    return mal::boolean(isZero);
                 }
+                return isZero ? mal::trueValue() : mal::nilValue();
             }
         }
 
@@ -575,13 +626,13 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 traceDebug = false;
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            std::unique_ptr<malValueVec> items(list->evalItems(env, 1));
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            env = lambda->makeEnv(std::move(*items));
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            std::unique_ptr<malValueVec> items(list->evalItems(env, 1));
             return APPLY(op, items->begin(), items->end());
         }
     }
@@ -592,7 +643,7 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -601,7 +652,7 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
     return handler->apply(argsBegin, argsEnd);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(const malValuePtr& obj, const String& text)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
     return sym && (sym->value() == text);
@@ -644,12 +695,214 @@ static malValuePtr quasiquote(malValuePtr obj)
     return res;
 }
 
+// Free variable analysis for closures. It only has to over-approximate:
+// a symbol wrongly taken to be free costs a capture, whereas one wrongly
+// taken to be bound would be looked up in the wrong env.
+
+static bool contains(const StringVec& names, const String& name)
+{
+    return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+static void addName(StringVec& names, const String& name)
+{
+    if (!contains(names, name)) {
+        names.push_back(name);
+    }
+}
+
+static void findFree(malValuePtr form, StringVec& scope, malCaptures& c);
+
+static void findFree(malValueIter begin, malValueIter end,
+                     StringVec& scope, malCaptures& c)
+{
+    for (auto it = begin; it != end; ++it) {
+        findFree(*it, scope, c);
+    }
+}
+
+static void bindName(malValuePtr name, StringVec& scope)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, name)) {
+        scope.push_back(sym->value());
+    }
+}
+
+static void bindNames(const malValue* bindings, StringVec& scope)
+{
+    if (const malSequence* seq = dynamic_cast<const malSequence*>(bindings)) {
+        for (auto it = seq->begin(); it != seq->end(); ++it) {
+            bindName(*it, scope);
+        }
+    }
+}
+
+static void setsName(malValuePtr target, StringVec& scope, malCaptures& c)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, target);
+    if (sym && !contains(scope, sym->value())) {
+        addName(c.free, sym->value());
+    }
+}
+
+static void findUnquoted(malValuePtr form, StringVec& scope, malCaptures& c)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq || seq->isEmpty()) {
+        return;
+    }
+    if (isSymbol(seq->item(0), "unquote") ||
+        isSymbol(seq->item(0), "splice-unquote")) {
+        findFree(seq->begin() + 1, seq->end(), scope, c);
+        return;
+    }
+    for (auto it = seq->begin(); it != seq->end(); ++it) {
+        findUnquoted(*it, scope, c);
+    }
+}
+
+static void findFree(malValuePtr form, StringVec& scope, malCaptures& c)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, form)) {
+        if (!contains(scope, sym->value())) {
+            addName(c.free, sym->value());
+        }
+        return;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        malValuePtr values = hash->values();
+        const malSequence* seq = STATIC_CAST(malSequence, values);
+        findFree(seq->begin(), seq->end(), scope, c);
+        return;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq || seq->isEmpty()) {
+        return;
+    }
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, seq->item(0));
+    if (!head || !DYNAMIC_CAST(malList, form)) {
+        findFree(seq->begin(), seq->end(), scope, c);
+        return;
+    }
+
+    // Special forms are recognised by name before any lookup, so the
+    // head of one is never a variable.
+    const String special = head->value();
+    const int count = seq->count();
+    const size_t outer = scope.size();
+    malValueIter end = seq->end();
+
+    if (special == "quote" || special == "trace" || special == "untrace") {
+        return;
+    }
+    if (special == "quasiquote") {
+        findUnquoted(form, scope, c);
+    }
+    else if (special == "fn*" || special == "lambda") {
+        if (count > 1) {
+            bindNames(seq->item(1).ptr(), scope);
+        }
+        findFree(seq->begin() + std::min(count, 2), end, scope, c);
+    }
+    else if (special == "defun") {
+        if (count > 1) {
+            setsName(seq->item(1), scope, c);
+        }
+        if (count > 2) {
+            bindNames(seq->item(2).ptr(), scope);
+        }
+        findFree(seq->begin() + std::min(count, 3), end, scope, c);
+    }
+    else if (special == "let*") {
+        // Each value sees the names bound before it, not its own, which
+        // may still refer to an outer binding.
+        const malSequence* bindings =
+            count > 1 ? DYNAMIC_CAST(malSequence, seq->item(1)) : NULL;
+        for (int i = 0; bindings && i + 1 < bindings->count(); i += 2) {
+            findFree(bindings->item(i + 1), scope, c);
+            bindName(bindings->item(i), scope);
+        }
+        findFree(seq->begin() + std::min(count, 2), end, scope, c);
+    }
+    else if (special == "foreach") {
+        if (count > 2) {
+            findFree(seq->item(2), scope, c);
+        }
+        if (count > 1) {
+            bindName(seq->item(1), scope);
+        }
+        findFree(seq->begin() + std::min(count, 3), end, scope, c);
+    }
+    else if (special == "try*") {
+        if (count > 1) {
+            findFree(seq->item(1), scope, c);
+        }
+        const malList* handler =
+            count > 2 ? DYNAMIC_CAST(malList, seq->item(2)) : NULL;
+        if (handler && handler->count() > 1) {
+            bindName(handler->item(1), scope);
+            findFree(handler->begin() + 2, handler->end(), scope, c);
+        }
+    }
+    else if (special == "setq" || special == "def!" ||
+             special == "defmacro!") {
+        for (int i = 1; i < count; i += 2) {
+            setsName(seq->item(i), scope, c);
+            if (i + 1 < count) {
+                findFree(seq->item(i + 1), scope, c);
+            }
+        }
+    }
+    else if (special == "set" || special == "bound?" || special == "boundp") {
+        c.isDynamic = true;
+    }
+    else if (special == "debug-eval") {
+        setsName(mal::symbol("DEBUG-EVAL"), scope, c);
+    }
+    else if (special == "setvar") {
+        findFree(seq->begin() + std::min(count, 2), end, scope, c);
+    }
+    else if (special == "cond" || special == "number?" ||
+             special == "numberp" ||
+             std::find(std::begin(malEvalFunctionTable),
+                       std::end(malEvalFunctionTable),
+                       special) != std::end(malEvalFunctionTable)) {
+        findFree(seq->begin() + 1, end, scope, c);
+    }
+    else {
+        if (!contains(scope, special)) {
+            addName(c.heads, special);
+        }
+        findFree(seq->begin(), end, scope, c);
+    }
+    scope.resize(outer);
+}
+
+static malValuePtr makeClosure(const malSequence* bindings, malValuePtr body,
+                               malEnvPtr env)
+{
+    // The parameter list is compiled once per fn* node and shared by
+    // every closure it creates, and so is the analysis of its body.
+    malParamsPtr params = bindings->params();
+    const malCaptures* captures = params->captures(body);
+    if (!captures) {
+        malCaptures found;
+        StringVec scope;
+        bindNames(bindings, scope);
+        findFree(body, scope, found);
+        found.optional.push_back("DEBUG-EVAL");
+        captures = &params->setCaptures(body, found);
+    }
+
+    // Closures keep only the variables they use, so returning one from a
+    // function doesn't keep every other local of that call alive.
+    return mal::lambda(params, body, env->capture(*captures));
+}
+
 static const char* malFunctionTable[] = {
-    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
-    "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
     "(def! *host-language* \"C++\")",
+    "(def! *print-length* nil)",
+    "(def! *print-level* nil)",
     "(def! append concat)",
     "(def! car first)",
     "(def! length count)",